@@ -0,0 +1,199 @@
+#ifndef KALEIDOSCOPE_AST_H
+#define KALEIDOSCOPE_AST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+
+
+namespace kaleidoscope {
+
+// Value types. Unannotated arguments and results are f64. Arrays are
+// unchecked pointers to host memory, written "f64[]".
+enum ValType : uint8_t
+{
+    type_bool,
+    type_i32,
+    type_i64,
+    type_f32,
+    type_f64,
+
+    type_i32_array,
+    type_i64_array,
+    type_f32_array,
+    type_f64_array
+};
+
+/* Expression trees
+ *
+ * A function body is stored flat in an ExprPool: the nodes in one array,
+ * referring to their operands by index, and literals, names, call
+ * arguments and var bindings in side arrays. Parsing a body is a series of
+ * push_backs into a handful of vectors, walking it reads consecutive
+ * memory, and codegen is a switch over the node kind instead of a virtual
+ * call per node. A pool is never shared between functions, so it is freed
+ * in one go with its FunctionAST.
+ *
+ * bench/astbench.cpp compares it with a tree of heap-allocated nodes.
+ */
+using ExprId = uint32_t;
+static const ExprId NoExpr = ~0u;
+
+enum ExprKind : uint8_t
+{
+    ek_number,      // Literals[Kid[0]]
+    ek_variable,    // Name
+    ek_index,       // Name[Kid[0]]
+    ek_binary,      // Kid[0] Op Kid[1]
+    ek_call,        // Name(Lists[Kid[0]] ... Lists[Kid[0] + Kid[1] - 1])
+    ek_if,          // if Kid[0] then Kid[1] else Kid[2]
+    ek_for,         // for Name = Kid[0], Kid[1], Kid[2] in Kid[3]; Kid[2] may be NoExpr
+    ek_var          // var Bindings[Kid[0]] ... Bindings[Kid[0] + Kid[1] - 1] in Kid[2]
+};
+
+enum ExprFlags : uint8_t
+{
+    ef_tail = 1,    // ek_call whose value is the function's result
+    ef_typed = 2    // ek_for with an annotated loop variable, of type Type
+};
+
+struct ExprNode
+{
+    ExprKind Kind;
+    char Op;
+    uint8_t Flags;
+    ValType Type;
+    uint32_t Name;  // index into Names
+    ExprId Kid[4];
+};
+
+// var x = init, y:i64 = init in body
+struct VarBinding
+{
+    uint32_t Name;
+    bool HasType;
+    ValType Type;
+    ExprId Init;    // may be NoExpr: zero
+};
+
+class ExprPool
+{
+    std::vector<ExprNode> Nodes;
+    std::vector<double> Literals;
+    std::vector<std::string> Names;
+    std::vector<ExprId> Lists;
+    std::vector<VarBinding> Bindings;
+    llvm::StringMap<uint32_t> NameIds;
+
+    ExprId add(ExprKind Kind, uint32_t Name, ExprId A = NoExpr, ExprId B = NoExpr,
+               ExprId C = NoExpr, ExprId D = NoExpr)
+    {
+        Nodes.push_back({Kind, 0, 0, type_f64, Name, {A, B, C, D}});
+        return Nodes.size() - 1;
+    }
+
+public:
+    const ExprNode &operator[](ExprId E) const
+    {
+        return Nodes[E];
+    }
+
+    ExprNode &operator[](ExprId E)
+    {
+        return Nodes[E];
+    }
+
+    size_t size() const
+    {
+        return Nodes.size();
+    }
+
+    double getLiteral(const ExprNode &N) const
+    {
+        return Literals[N.Kid[0]];
+    }
+
+    const std::string &getName(uint32_t Name) const
+    {
+        return Names[Name];
+    }
+
+    llvm::ArrayRef<ExprId> getArgs(const ExprNode &N) const
+    {
+        return llvm::makeArrayRef(Lists).slice(N.Kid[0], N.Kid[1]);
+    }
+
+    llvm::ArrayRef<VarBinding> getBindings(const ExprNode &N) const
+    {
+        return llvm::makeArrayRef(Bindings).slice(N.Kid[0], N.Kid[1]);
+    }
+
+    // Names are interned, so a function mentioning x a thousand times
+    // stores it once.
+    uint32_t intern(llvm::StringRef Name)
+    {
+        auto I = NameIds.insert({Name, (uint32_t)Names.size()});
+        if (I.second)
+            Names.push_back(Name.str());
+        return I.first->second;
+    }
+
+    ExprId addNumber(double Val)
+    {
+        Literals.push_back(Val);
+        return add(ek_number, 0, Literals.size() - 1);
+    }
+
+    ExprId addVariable(llvm::StringRef Name)
+    {
+        return add(ek_variable, intern(Name));
+    }
+
+    ExprId addIndex(llvm::StringRef Name, ExprId Index)
+    {
+        return add(ek_index, intern(Name), Index);
+    }
+
+    ExprId addBinary(char Op, ExprId LHS, ExprId RHS)
+    {
+        ExprId E = add(ek_binary, 0, LHS, RHS);
+        Nodes[E].Op = Op;
+        return E;
+    }
+
+    ExprId addCall(llvm::StringRef Callee, llvm::ArrayRef<ExprId> Args)
+    {
+        ExprId First = Lists.size();
+        Lists.insert(Lists.end(), Args.begin(), Args.end());
+        return add(ek_call, intern(Callee), First, Args.size());
+    }
+
+    ExprId addIf(ExprId Cond, ExprId Then, ExprId Else)
+    {
+        return add(ek_if, 0, Cond, Then, Else);
+    }
+
+    ExprId addFor(llvm::StringRef VarName, bool HasType, ValType VarType,
+                  ExprId Start, ExprId End, ExprId Step, ExprId Body)
+    {
+        ExprId E = add(ek_for, intern(VarName), Start, End, Step, Body);
+        Nodes[E].Flags = HasType ? ef_typed : 0;
+        Nodes[E].Type = VarType;
+        return E;
+    }
+
+    ExprId addVar(llvm::ArrayRef<VarBinding> Vars, ExprId Body)
+    {
+        ExprId First = Bindings.size();
+        Bindings.insert(Bindings.end(), Vars.begin(), Vars.end());
+        return add(ek_var, 0, First, Vars.size(), Body);
+    }
+};
+
+} // namespace kaleidoscope
+
+#endif
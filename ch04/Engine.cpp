@@ -0,0 +1,3601 @@
+#include <string>
+#include <cctype>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <fstream>
+#include <ctime>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/ADT/APFloat.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include "../include/KaleidoscopeJIT.h"
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Vectorize.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/InlineCost.h>
+#include <llvm/Analysis/CFG.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Pass.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/CodeGen.h>
+
+#include "AST.h"
+#include "Engine.h"
+#include "Number.h"
+#include "Scan.h"
+#include "Trace.h"
+
+
+
+enum Token {
+    tok_eof=-1,
+
+    tok_def=-2,
+    tok_extern=-3,
+
+    tok_identifier=-4, //getIdentifier()
+    tok_number=-5,  //getNumVal()
+
+    tok_for=-6,
+    tok_in=-7,
+    tok_var=-8,
+
+    tok_if=-9,
+    tok_then=-10,
+    tok_else=-11,
+
+    tok_memo=-12,
+
+    tok_bad_number=-13  // e.g. "1.2.3"
+};
+
+
+// A token of the source being compiled. Identifiers are spans of the
+// source, numbers are converted when they are lexed.
+struct Lexeme
+{
+    int Kind;
+    uint32_t Offset;
+    uint32_t Length;
+    double NumVal;
+};
+
+// Binary operator precedence by token character, -1 for anything that is
+// not a binary operator. Flat so that ParseExpression does no hashing.
+struct PrecedenceTable
+{
+    int8_t Prec[256];
+};
+
+static constexpr PrecedenceTable MakeDefaultPrecedence()
+{
+    PrecedenceTable T{};
+    for (int8_t &P : T.Prec)
+        P = -1;
+
+    T.Prec[':'] = 1;
+    T.Prec['='] = 2;
+    T.Prec['<'] = 10;
+    T.Prec['+'] = 20;
+    T.Prec['-'] = 20;
+    T.Prec['*'] = 40;
+    return T;
+}
+
+static constexpr PrecedenceTable DefaultPrecedence = MakeDefaultPrecedence();
+
+// What a definition is known to do; inferred once it is optimized (Purity).
+struct FunctionEffects
+{
+    bool ReadNone, ReadOnly, NoUnwind, WillReturn;
+};
+
+// Counters a definition's wrapper updates under EngineOptions::CallStats
+// (Call statistics). Depth is the number of its calls in progress.
+struct CallCounters
+{
+    uint64_t Calls = 0, Cycles = 0, Depth = 0;
+};
+
+// By definition name. Entries are never removed, so JIT'd code can hold
+// their addresses; the lock is for workers adding to it.
+struct CallStatsTable
+{
+    std::mutex Lock;
+    std::map<std::string, CallCounters> Functions;
+};
+
+// Classes with code of their own live in anonymous namespaces, so that
+// they stay internal to the library: a host embedding it may well have its
+// own PrototypeAST.
+namespace {
+class PrototypeAST;
+class FunctionAST;
+struct MemoCache;
+class CompilePool;
+}
+
+/* Session
+ *
+ * Everything one Engine compiles into: its lexer and parser state, operator
+ * table, LLVM context, declarations and definitions, profile and memo
+ * state, and its own symbol namespace in the JIT. The JIT itself, with the
+ * target machine and compile layers, is shared by all sessions in the
+ * process. The functions below work on TheSession, which the Engine sets
+ * for the duration of each call into it.
+ */
+namespace kaleidoscope {
+struct Session
+{
+    EngineOptions Opts;
+
+    // Source being compiled by Engine::compile(), lexed up front. Tokens
+    // is reused by every compile(); NextTok is the index of the token after
+    // Curtok.
+    llvm::StringRef Source;
+    std::vector<Lexeme> Tokens;
+    size_t NextTok = 0;
+    int Curtok;
+
+    std::string LastError;
+    // Every error of the current compile(), in order.
+    std::vector<std::string> Errors;
+    bool HadError = false;
+
+    PrecedenceTable BinOpPrecedence = DefaultPrecedence;
+
+    llvm::LLVMContext TheContext;
+    std::unique_ptr<llvm::IRBuilder<>> Builder;
+    std::unique_ptr<llvm::Module> TheModule;
+    std::unordered_map<std::string, llvm::AllocaInst*> NamedValues;
+    std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
+    std::unique_ptr<llvm::legacy::PassManager> TheMPM;
+
+    std::shared_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+    llvm::orc::KaleidoscopeJIT::Dylib *TheDylib = nullptr;
+
+    // Every function ever declared, so later modules can re-declare it.
+    std::map<std::string, std::shared_ptr<PrototypeAST>> FunctionProtos;
+    // Bodies of JIT'd definitions, kept for cross-module inlining (-ipo).
+    std::map<std::string, std::shared_ptr<FunctionAST>> FunctionDefs;
+    // Instructions in the last imported copy of each of them, and the body
+    // that was measured (ImportDefinitions).
+    std::map<std::string, std::pair<std::shared_ptr<FunctionAST>, unsigned>> ImportSizes;
+
+    // Live PGO counters. A deque never moves its elements, so JIT'd code can
+    // hold their addresses. A redefinition shares its predecessor's counters.
+    std::map<std::string, std::deque<uint64_t>> ProfileCounters;
+    // Counters read from -pgo-use.
+    std::map<std::string, std::vector<uint64_t>> LoadedProfile;
+    // Shape (ProfileShape) of the body each function's counters belong to:
+    // the last one emitted under -pgo-gen / the one the loaded profile was
+    // taken from.
+    std::map<std::string, uint64_t> CounterShapes;
+    std::map<std::string, uint64_t> LoadedShapes;
+    uint64_t ProfileHotCount = 0;
+    // The function being emitted (empty if it is not profiled) and the index
+    // of its next counter.
+    std::string ProfileFn;
+    unsigned NextProfileCounter;
+
+    std::map<std::string, FunctionEffects> InferredEffects;
+    // The functions each definition's effects were inferred through.
+    std::map<std::string, std::set<std::string>> EffectCallees;
+    // extern name -> intrinsic and the FP type it is instantiated with
+    std::map<std::string, std::pair<llvm::Intrinsic::ID, llvm::Type*>> MathBuiltins;
+
+    // Kept as long as the session: code JIT'd for older definitions may
+    // still use them.
+    std::vector<std::unique_ptr<MemoCache>> MemoCaches;
+
+    // Call counters (EngineOptions::CallStats), shared with the workers;
+    // null if off.
+    std::shared_ptr<CallStatsTable> CallStats;
+
+    // Values of the top-level expressions of the current compile(), if wanted.
+    std::vector<double> *Results = nullptr;
+
+    // ParseExpression calls in progress (MaxExprNesting).
+    unsigned ExprNesting = 0;
+
+    // Sessions compiling definitions for this one on the threads of the
+    // process-wide Pool, created on first use (Parallel definitions). A
+    // worker uses the target machine of the thread running it; everyone
+    // else uses the JIT's.
+    std::shared_ptr<CompilePool> Pool;
+    std::vector<std::unique_ptr<Session>> Workers;
+    llvm::TargetMachine *WorkerTM = nullptr;
+    unsigned BatchVisible = 0;  // worker: batch definitions it can see
+    std::vector<bool> BatchShownDone;  // worker: was each done when shown?
+
+    // Where dumps (Dumps) go: stderr, or on a worker the text of the
+    // definition it is compiling, printed in order once the batch is done.
+    llvm::raw_ostream *DumpOS = nullptr;
+
+    // Stage timing (EngineOptions::Timing), shared with the workers; null
+    // if off. PassClock is when the last pass timing marker ran.
+    std::shared_ptr<Timeline> Trace;
+    uint64_t PassClock = 0;
+};
+} // namespace kaleidoscope
+
+// Per thread, so that worker threads each compile into their own session.
+static thread_local kaleidoscope::Session *TheSession = nullptr;
+
+// Makes S TheSession until the end of the scope.
+class SessionScope
+{
+    kaleidoscope::Session *Prev;
+
+public:
+    explicit SessionScope(kaleidoscope::Session *S) : Prev(TheSession)
+    {
+        TheSession = S;
+    }
+
+    ~SessionScope()
+    {
+        TheSession = Prev;
+    }
+};
+
+
+/* Keywords
+ *
+ * (first char + second char + length) % 16 gives every keyword a slot of
+ * its own, so an identifier is a keyword only if it equals the one keyword
+ * in its slot. The static_assert re-checks this when a keyword is added;
+ * if it fires, find new constants for KeywordHash.
+ */
+struct Keyword
+{
+    const char *Name;
+    unsigned Len;
+    int Tok;
+};
+
+static constexpr Keyword Keywords[] = {
+    {"def", 3, tok_def},    {"extern", 6, tok_extern}, {"for", 3, tok_for},
+    {"in", 2, tok_in},      {"var", 3, tok_var},       {"if", 2, tok_if},
+    {"then", 4, tok_then},  {"else", 4, tok_else},     {"memo", 4, tok_memo}
+};
+static constexpr unsigned MinKeywordLen = 2, MaxKeywordLen = 6;
+
+static constexpr unsigned KeywordHash(const char *S, unsigned Len)
+{
+    return ((unsigned char)S[0] + (unsigned char)S[1] + Len) % 16;
+}
+
+struct KeywordTable
+{
+    Keyword Slots[16];
+};
+
+static constexpr KeywordTable MakeKeywordTable()
+{
+    KeywordTable T{};
+    for (const Keyword &K : Keywords)
+        T.Slots[KeywordHash(K.Name, K.Len)] = K;
+    return T;
+}
+
+static constexpr bool KeywordHashIsPerfect()
+{
+    KeywordTable T = MakeKeywordTable();
+    for (const Keyword &K : Keywords)
+        if (T.Slots[KeywordHash(K.Name, K.Len)].Tok != K.Tok)
+            return false;
+    return true;
+}
+static_assert(KeywordHashIsPerfect(), "two keywords share a KeywordHash slot");
+
+static constexpr KeywordTable KeywordSlots = MakeKeywordTable();
+
+static int LookupKeyword(const char *S, unsigned Len)
+{
+    if (Len < MinKeywordLen || Len > MaxKeywordLen)
+        return tok_identifier;
+
+    const Keyword &K = KeywordSlots.Slots[KeywordHash(S, Len)];
+    if (K.Len == Len && memcmp(K.Name, S, Len) == 0)
+        return K.Tok;
+    return tok_identifier;
+}
+
+static int gettok(const char *&P, const char *End, Lexeme &Tok) // lexer
+{
+    // Whitespace and comments, which run to the end of the line; comments
+    // get no token.
+    while (true)
+    {
+        P = kaleidoscope::skip<kaleidoscope::cc_space>(P, End);
+        if (P == End || *P != '#')
+            break;
+        P = kaleidoscope::skip<kaleidoscope::cc_not_line_end>(P, End);
+    }
+
+    Tok.Offset = P - TheSession->Source.begin();
+    Tok.Length = 1;
+
+    if (P == End)
+        return tok_eof;
+
+    const char *Start = P;
+
+    if (isalpha((unsigned char)*P))  // first char cannot be number if it is keyword/variable
+    {
+        P = kaleidoscope::skip<kaleidoscope::cc_alnum>(P + 1, End);
+        Tok.Length = P - Start;
+
+        return LookupKeyword(Start, Tok.Length);
+    }
+
+    if (isdigit((unsigned char)*P) || *P == '.')   // Num values (Double (float64))
+    {
+        P = kaleidoscope::skip<kaleidoscope::cc_number>(P + 1, End);
+        Tok.Length = P - Start;
+
+        if (!kaleidoscope::parseNumber(Start, P, Tok.NumVal))
+            return tok_bad_number;
+        return tok_number;
+    }
+
+    return (unsigned char)*P++;
+}
+
+// Lex all of Source into TheSession->Tokens, ending with tok_eof.
+static void LexSource(llvm::StringRef Source)
+{
+    auto &Tokens = TheSession->Tokens;
+    Tokens.clear();     // keeps its capacity for the next compile()
+    TheSession->Source = Source;
+    TheSession->NextTok = 0;
+
+    const char *P = Source.begin();
+    Lexeme Tok;
+    do
+    {
+        Tok.Kind = gettok(P, Source.end(), Tok);
+        Tokens.push_back(Tok);
+    } while (Tok.Kind != tok_eof);
+}
+
+
+// The value types and the expression pool (AST.h) are used unqualified.
+using namespace kaleidoscope;
+
+
+// Marks the calls whose value is the function's result, which become tail
+// calls: through the RHS of ':', both branches of an if, and var bodies.
+static void MarkTailCalls(ExprPool &P, ExprId E)
+{
+    while (true)
+    {
+        ExprNode &N = P[E];
+        switch (N.Kind)
+        {
+        case ek_call:
+            N.Flags |= ef_tail;
+            return;
+        case ek_binary:
+            if (N.Op != ':')
+                return;
+            E = N.Kid[1];
+            break;
+        case ek_if:
+            MarkTailCalls(P, N.Kid[1]);
+            E = N.Kid[2];
+            break;
+        case ek_var:
+            E = N.Kid[2];
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+
+namespace {
+
+// Function Prototype
+class PrototypeAST
+{
+    std::string Name;
+    std::vector<std::string> Args;
+    std::vector<ValType> ArgTypes;
+    ValType RetType;
+
+public:
+    PrototypeAST(const std::string &name, std::vector<std::string> args,
+                 std::vector<ValType> argTypes = {}, ValType retType = type_f64)
+        : Name(name), Args(args), ArgTypes(std::move(argTypes)), RetType(retType)
+    {
+        ArgTypes.resize(Args.size(), type_f64);
+    }
+
+    const std::string &getName() const 
+    {
+        return Name;
+    }
+
+    llvm::FunctionType *getFunctionType() const;
+    std::string getSignature() const;   // "f64(i64,f64[])"
+    virtual llvm::Function *codegen();
+};
+
+
+// Function defination
+using uptrProto = typename std::unique_ptr<PrototypeAST>;
+class FunctionAST
+{
+    uptrProto Proto;
+    ExprPool Pool;
+    ExprId Body;
+    bool IsMemo;
+    MemoCache *Cache = nullptr;    // memo only, shared by re-emitted copies
+
+public:
+    FunctionAST(uptrProto proto, ExprPool pool, ExprId body, bool isMemo = false)
+        : Proto(std::move(proto)), Pool(std::move(pool)), Body(body), IsMemo(isMemo)
+    {
+        MarkTailCalls(Pool, Body);
+    }
+
+    const std::string &getName() const
+    {
+        return Proto->getName();
+    }
+
+    const PrototypeAST &getProto() const
+    {
+        return *Proto;
+    }
+
+    const ExprPool &getBody() const
+    {
+        return Pool;
+    }
+
+    virtual llvm::Function *codegen();
+};
+
+} // namespace
+
+// Parser
+static int getNextToken() 
+{
+    auto &Tokens = TheSession->Tokens;
+    if (TheSession->NextTok < Tokens.size())    // stay on tok_eof
+        ++TheSession->NextTok;
+    TheSession->Curtok = Tokens[TheSession->NextTok - 1].Kind;
+    return TheSession->Curtok;
+}
+
+// Kind of the N'th token after Curtok, without consuming anything.
+static int peekToken(unsigned N = 1)
+{
+    auto &Tokens = TheSession->Tokens;
+    return Tokens[std::min(TheSession->NextTok - 1 + N, Tokens.size() - 1)].Kind;
+}
+
+// Payload of Curtok: the name of a tok_identifier (the source text of any
+// token, really), the value of a tok_number.
+static llvm::StringRef getIdentifier()
+{
+    const Lexeme &Tok = TheSession->Tokens[TheSession->NextTok - 1];
+    return TheSession->Source.substr(Tok.Offset, Tok.Length);
+}
+
+static double getNumVal()
+{
+    return TheSession->Tokens[TheSession->NextTok - 1].NumVal;
+}
+
+// Error Handling: errors are recorded for Engine::getErrors(), not printed.
+static ExprId LogError(const char *str)
+{
+    TheSession->LastError = str;
+    TheSession->Errors.push_back(str);
+    TheSession->HadError = true;
+    return NoExpr;
+}
+
+static uptrProto LogErrorP(const char *str)
+{
+    LogError(str);
+    return nullptr;
+}
+
+// Forward declarations For parsing functions
+static ExprId ParseNumberExpr(ExprPool &P);
+static ExprId ParseExpression(ExprPool &P);
+static ExprId ParsePrimary(ExprPool &P);
+static ExprId ParseIdentifierExpr(ExprPool &P);
+static bool ParseTypeAnnotation(ValType &);
+
+
+// Expr Parsing
+static ExprId ParseNumberExpr(ExprPool &P)
+{
+    ExprId Result = P.addNumber(getNumVal());
+    getNextToken();
+
+    return Result;
+}
+
+
+static ExprId ParseIdentifierExpr(ExprPool &P)
+{
+    llvm::StringRef IdName = getIdentifier();
+
+    if (peekToken() != '[' && peekToken() != '(')  // form identifier are Variables
+    {
+        getNextToken();
+        return P.addVariable(IdName);
+    }
+
+    getNextToken();
+
+    if (TheSession->Curtok == '[')  // identifier[index] is an array element
+    {
+        getNextToken(); // [ gone
+        ExprId Index = ParseExpression(P);
+        if (Index == NoExpr)
+            return NoExpr;
+
+        if (TheSession->Curtok != ']')
+            return LogError("expected ']'");
+        getNextToken();
+
+        return P.addIndex(IdName, Index);
+    }
+
+    getNextToken(); // ( gone
+
+
+    /* Identifier() is a call */
+    std::vector<ExprId> Args;
+    if (TheSession->Curtok != ')')
+    {
+        while (true)
+        {
+            ExprId Arg = ParseExpression(P);
+            if (Arg == NoExpr)
+                return NoExpr;
+            Args.push_back(Arg);
+
+            if (TheSession->Curtok == ')')
+                break;
+
+            if (TheSession->Curtok != ',')
+                return LogError("Expected ')' or ','");
+            getNextToken();
+        }
+    }
+
+    getNextToken();
+
+    return P.addCall(IdName, Args);
+}
+
+static ExprId ParseIfExpr(ExprPool &P)
+{
+    getNextToken(); // eat if
+
+    ExprId Cond = ParseExpression(P);
+    if (Cond == NoExpr)
+        return NoExpr;
+
+    if (TheSession->Curtok != tok_then)
+        return LogError("expected then");
+    getNextToken();
+
+    ExprId Then = ParseExpression(P);
+    if (Then == NoExpr)
+        return NoExpr;
+
+    if (TheSession->Curtok != tok_else)
+        return LogError("expected else");
+    getNextToken();
+
+    ExprId Else = ParseExpression(P);
+    if (Else == NoExpr)
+        return NoExpr;
+
+    return P.addIf(Cond, Then, Else);
+}
+
+static ExprId ParseForExpr(ExprPool &P)
+{
+    getNextToken(); // eat for
+
+    if (TheSession->Curtok != tok_identifier)
+        return LogError("expected identifier after for");
+
+    llvm::StringRef IdName = getIdentifier();
+    getNextToken();
+
+    bool HasType = TheSession->Curtok == ':';
+    ValType VarType = type_f64;
+    if (HasType && !ParseTypeAnnotation(VarType))
+        return NoExpr;
+
+    if (TheSession->Curtok != '=')
+        return LogError("expected '=' after for");
+    getNextToken();
+
+    ExprId Start = ParseExpression(P);
+    if (Start == NoExpr)
+        return NoExpr;
+    if (TheSession->Curtok != ',')
+        return LogError("expected ',' after for start value");
+    getNextToken();
+
+    ExprId End = ParseExpression(P);
+    if (End == NoExpr)
+        return NoExpr;
+
+    ExprId Step = NoExpr;   // optional, defaults to 1
+    if (TheSession->Curtok == ',')
+    {
+        getNextToken();
+        Step = ParseExpression(P);
+        if (Step == NoExpr)
+            return NoExpr;
+    }
+
+    if (TheSession->Curtok != tok_in)
+        return LogError("expected 'in' after for");
+    getNextToken();
+
+    ExprId Body = ParseExpression(P);
+    if (Body == NoExpr)
+        return NoExpr;
+
+    return P.addFor(IdName, HasType, VarType, Start, End, Step, Body);
+}
+
+static ExprId ParseVarExpr(ExprPool &P)
+{
+    getNextToken(); // eat var
+
+    std::vector<VarBinding> Vars;
+    if (TheSession->Curtok != tok_identifier)
+        return LogError("expected identifier after var");
+
+    while (true)
+    {
+        VarBinding B;
+        B.Name = P.intern(getIdentifier());
+        getNextToken();
+
+        B.HasType = TheSession->Curtok == ':';
+        B.Type = type_f64;
+        if (B.HasType && !ParseTypeAnnotation(B.Type))
+            return NoExpr;
+
+        B.Init = NoExpr;
+        if (TheSession->Curtok == '=')
+        {
+            getNextToken();
+            B.Init = ParseExpression(P);
+            if (B.Init == NoExpr)
+                return NoExpr;
+        }
+
+        Vars.push_back(B);
+
+        if (TheSession->Curtok != ',')
+            break;
+        getNextToken();
+
+        if (TheSession->Curtok != tok_identifier)
+            return LogError("expected identifier list after var");
+    }
+
+    if (TheSession->Curtok != tok_in)
+        return LogError("expected 'in' keyword after 'var'");
+    getNextToken();
+
+    ExprId Body = ParseExpression(P);
+    if (Body == NoExpr)
+        return NoExpr;
+
+    return P.addVar(Vars, Body);
+}
+
+static ExprId ParsePrimary(ExprPool &P)
+{
+    switch (TheSession->Curtok)
+    {
+    case tok_identifier:
+        return ParseIdentifierExpr(P);
+        break;
+    case tok_number:
+        return ParseNumberExpr(P);
+        break;
+    case tok_bad_number:
+        return LogError(("Malformed number " + getIdentifier().str()).c_str());
+    case tok_if:
+        return ParseIfExpr(P);
+        break;
+    case tok_for:
+        return ParseForExpr(P);
+        break;
+    case tok_var:
+        return ParseVarExpr(P);
+        break;
+    default:
+        return LogError("Unknown Token");
+    }
+}
+
+// Binops
+static int GetTokenPrecedence()
+{
+    unsigned Tok = TheSession->Curtok;  // keywords etc. are negative, so huge
+    if (Tok >= 256)
+        return -1;
+
+    return TheSession->BinOpPrecedence.Prec[Tok];
+}
+
+
+/* Expressions
+ *
+ * Parentheses and binary operators are parsed with explicit operand and
+ * operator stacks (shunting-yard) rather than by recursion, so machine
+ * generated input nested tens of thousands of levels deep does not run
+ * out of native stack. '(' is pushed on the operator stack as a marker
+ * and ')' reduces back to it. All operators are left associative.
+ *
+ * if/for/var parts, call arguments and indices are parsed by a nested
+ * ParseExpression, and generated by recursion too. Rather than let
+ * f(f(f(...))) overflow the stack here or in codegen, expressions nested
+ * that way more than MaxExprNesting deep are an error.
+ */
+static const unsigned MaxExprNesting = 1000;
+
+namespace {
+class ExprNestingScope
+{
+public:
+    ExprNestingScope()
+    {
+        ++TheSession->ExprNesting;
+    }
+
+    ~ExprNestingScope()
+    {
+        --TheSession->ExprNesting;
+    }
+};
+} // namespace
+
+static ExprId ParseExpression(ExprPool &P)
+{
+    if (TheSession->ExprNesting >= MaxExprNesting)
+        return LogError("Expression nested too deeply");
+    ExprNestingScope Nesting;
+
+    const int OpenParen = -1;   // marker on Ops, never a binary operator
+    std::vector<ExprId> Operands;
+    std::vector<int> Ops;
+    size_t OpenParens = 0;
+
+    auto Reduce = [&]()
+    {
+        ExprId RHS = Operands.back();
+        Operands.pop_back();
+        Operands.back() = P.addBinary(Ops.back(), Operands.back(), RHS);
+        Ops.pop_back();
+    };
+
+    while (true)
+    {
+        /* An operand, after any number of '(' */
+        while (TheSession->Curtok == '(')
+        {
+            Ops.push_back(OpenParen);
+            ++OpenParens;
+            getNextToken();
+        }
+
+        ExprId Operand = ParsePrimary(P);
+        if (Operand == NoExpr)
+            return NoExpr;
+        Operands.push_back(Operand);
+
+        /* Then any number of ')', and an operator or the end */
+        while (TheSession->Curtok == ')' && OpenParens)
+        {
+            while (Ops.back() != OpenParen)
+                Reduce();
+            Ops.pop_back();
+            --OpenParens;
+            getNextToken();
+        }
+
+        int TokPrec = GetTokenPrecedence();
+        if (TokPrec < 0)
+            break;
+
+        while (!Ops.empty() && Ops.back() != OpenParen &&
+               TheSession->BinOpPrecedence.Prec[Ops.back()] >= TokPrec)
+            Reduce();
+
+        Ops.push_back(TheSession->Curtok);
+        getNextToken();
+    }
+
+    if (OpenParens)
+        return LogError("expected ')'");
+
+    while (!Ops.empty())
+        Reduce();
+    return Operands.back();
+}
+
+// Prototype
+
+// ':' type, as in "x:i64". Eats both tokens.
+static bool ParseTypeAnnotation(ValType &Ty)
+{
+    getNextToken(); // eat :
+
+    static const llvm::StringMap<ValType> TypeNames = {
+        {"bool", type_bool}, {"i32", type_i32}, {"i64", type_i64},
+        {"f32", type_f32}, {"f64", type_f64}
+    };
+
+    auto TI = TypeNames.find(getIdentifier());
+    if (TheSession->Curtok != tok_identifier || TI == TypeNames.end())
+    {
+        LogError("Expected type (bool, i32, i64, f32 or f64)");
+        return false;
+    }
+
+    Ty = TI->second;
+    getNextToken();
+
+    if (TheSession->Curtok != '[')
+        return true;
+
+    getNextToken(); // [
+    if (TheSession->Curtok != ']')
+    {
+        LogError("Expected ']' in array type");
+        return false;
+    }
+    getNextToken();
+
+    switch (Ty)
+    {
+        case type_i32: Ty = type_i32_array; return true;
+        case type_i64: Ty = type_i64_array; return true;
+        case type_f32: Ty = type_f32_array; return true;
+        case type_f64: Ty = type_f64_array; return true;
+        default:
+            LogError("Arrays of bool are not supported");
+            return false;
+    }
+}
+
+static uptrProto ParsePrototype()
+{
+    if (TheSession->Curtok != tok_identifier)
+        return LogErrorP("Expected function name in prototype");
+    
+    std::string fnName = getIdentifier().str();
+    getNextToken();
+
+    if (TheSession->Curtok != '(')
+        return LogErrorP("Expected ( ");
+
+    std::vector<std::string> ArgNames;
+    std::vector<ValType> ArgTypes;
+    getNextToken();
+    while (TheSession->Curtok == tok_identifier)
+    {
+        ArgNames.push_back(getIdentifier().str());
+        getNextToken();
+
+        ValType Ty = type_f64;
+        if (TheSession->Curtok == ':' && !ParseTypeAnnotation(Ty))
+            return nullptr;
+        ArgTypes.push_back(Ty);
+    }
+
+    if (TheSession->Curtok != ')')
+        return LogErrorP("Expected )");
+
+    getNextToken();
+
+    ValType RetType = type_f64;
+    if (TheSession->Curtok == ':' && !ParseTypeAnnotation(RetType))
+        return nullptr;
+    
+    return std::unique_ptr<PrototypeAST>(
+        new PrototypeAST(fnName, std::move(ArgNames), std::move(ArgTypes), RetType)
+    );
+}
+
+
+static std::unique_ptr<FunctionAST> ParseDefinition()
+{
+    bool IsMemo = TheSession->Curtok == tok_memo;
+    if (IsMemo && getNextToken() != tok_def)
+    {
+        LogError("Expected def after memo");
+        return nullptr;
+    }
+
+    getNextToken(); // eat def
+    auto Proto = ParsePrototype();
+    if (!Proto)
+        return nullptr;
+
+    ExprPool Pool;
+    ExprId Expr = ParseExpression(Pool);
+    if (Expr == NoExpr)
+        return nullptr;
+        
+    return std::unique_ptr<FunctionAST>(
+            new FunctionAST(std::move(Proto), std::move(Pool), Expr, IsMemo)
+        );
+}
+
+static uptrProto ParseExtern()
+{
+    getNextToken(); //eat extern;
+    return ParsePrototype();
+}
+
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+{
+    ExprPool Pool;
+    ExprId Expr = ParseExpression(Pool);
+    if (Expr != NoExpr)
+    {
+        auto Proto = std::unique_ptr<PrototypeAST>(
+            new PrototypeAST("__anon__", std::vector<std::string>())
+        );
+        return std::unique_ptr<FunctionAST>(
+            new FunctionAST(std::move(Proto), std::move(Pool), Expr)
+        );
+    }
+    return nullptr;
+}
+
+/* LLVM */
+static llvm::Value *LogErrorV(const char *Str)
+{
+    LogError(Str);
+    return nullptr;
+}
+
+
+// Host memory that JIT'd code reads and writes by absolute address.
+static llvm::Constant *getHostPointer(const void *Addr, llvm::Type *PointeeTy)
+{
+    return llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(TheSession->TheContext), (uint64_t)(uintptr_t)Addr),
+        PointeeTy->getPointerTo());
+}
+
+static void EmitHostIncrement(uint64_t *Counter, const char *Name)
+{
+    auto *Int64Ty = llvm::Type::getInt64Ty(TheSession->TheContext);
+    auto *Addr = getHostPointer(Counter, Int64Ty);
+
+    llvm::Value *Count = TheSession->Builder->CreateLoad(Int64Ty, Addr, Name);
+    Count = TheSession->Builder->CreateAdd(Count, llvm::ConstantInt::get(Int64Ty, 1), "inc");
+    TheSession->Builder->CreateStore(Count, Addr);
+}
+
+
+/* Profile-guided optimization
+ *
+ * With ProfileGen set, every definition bumps a counter on entry, before each call
+ * it makes, on each side of its ifs, and on entry to and each iteration of
+ * its loops. Counters live on the host, so they survive the JIT modules
+ * that update them, and are written to the profile file at exit. A function's
+ * counters are numbered in codegen order, which is how a profile loaded with
+ * ProfileUse finds them again on the next run. That only holds for the same
+ * body, so each function's profile carries a hash of its body's shape, and
+ * one taken from a different shape is ignored.
+ */
+
+// FNV-1a over the node kinds, operators, operand indices and callees of a
+// body: everything that decides where its counters go, but not literals or
+// variable names.
+static uint64_t ProfileShape(const ExprPool &P)
+{
+    uint64_t H = 0xcbf29ce484222325ULL;
+    auto Mix = [&](uint64_t V) {
+        for (unsigned i = 0; i != 8; ++i)
+        {
+            H ^= (V >> (i * 8)) & 0xff;
+            H *= 0x100000001b3ULL;
+        }
+    };
+
+    for (ExprId E = 0; E != P.size(); ++E)
+    {
+        const ExprNode &N = P[E];
+        Mix(N.Kind | (uint64_t)(uint8_t)N.Op << 8);
+        for (ExprId K : N.Kid)
+            Mix(K);
+        if (N.Kind == ek_call)
+            for (char C : P.getName(N.Name))
+                Mix((uint8_t)C);
+    }
+    return H;
+}
+
+static void BeginFunctionProfile(const std::string &Name, const ExprPool &Body)
+{
+    TheSession->ProfileFn = Name;
+    TheSession->NextProfileCounter = 0;
+    if (Name.empty())
+        return;
+
+    uint64_t Shape = ProfileShape(Body);
+    if (!TheSession->Opts.ProfileGen.empty())
+        TheSession->CounterShapes[Name] = Shape;
+
+    auto PI = TheSession->LoadedProfile.find(Name);
+    if (PI != TheSession->LoadedProfile.end() && TheSession->LoadedShapes[Name] != Shape)
+    {
+        fprintf(stderr, "Profile of %s is for a different body, ignoring it\n", Name.c_str());
+        TheSession->LoadedProfile.erase(PI);
+    }
+}
+
+// Emit an increment of the next counter of the current function (under
+// -pgo-gen) and return the count it had in the loaded profile, if any.
+static uint64_t EmitProfileCounter()
+{
+    if (TheSession->ProfileFn.empty())
+        return 0;
+
+    unsigned Idx = TheSession->NextProfileCounter++;
+
+    if (!TheSession->Opts.ProfileGen.empty())
+    {
+        auto &Counters = TheSession->ProfileCounters[TheSession->ProfileFn];
+        if (Counters.size() <= Idx)
+            Counters.resize(Idx + 1);
+
+        EmitHostIncrement(&Counters[Idx], "pgo.count");
+    }
+
+    auto PI = TheSession->LoadedProfile.find(TheSession->ProfileFn);
+    if (PI == TheSession->LoadedProfile.end() || PI->second.size() <= Idx)
+        return 0;
+    return PI->second[Idx];
+}
+
+static bool HasProfile(const std::string &Name)
+{
+    return TheSession->LoadedProfile.count(Name) != 0;
+}
+
+// Branch weights are 32-bit; scale large counts down keeping their ratio.
+static llvm::MDNode *getBranchWeights(uint64_t Taken, uint64_t NotTaken)
+{
+    uint64_t Max = std::max(Taken, NotTaken);
+    uint64_t Scale = Max > UINT32_MAX ? Max / UINT32_MAX + 1 : 1;
+    return llvm::MDBuilder(TheSession->TheContext).createBranchWeights(
+        (uint32_t)(Taken / Scale), (uint32_t)(NotTaken / Scale));
+}
+
+// Profile file: a ProfileHeader line, then one line per function,
+// "<name> <shape> <n> <count0> ... <countn-1>", the shape in hex.
+static const char ProfileHeader[] = "kaleidoscope-profile 2";
+
+static void WriteProfile()
+{
+    FILE *F = fopen(TheSession->Opts.ProfileGen.c_str(), "w");
+    if (!F)
+    {
+        fprintf(stderr, "Cannot write profile %s\n", TheSession->Opts.ProfileGen.c_str());
+        return;
+    }
+
+    fprintf(F, "%s\n", ProfileHeader);
+    for (auto &P : TheSession->ProfileCounters)
+    {
+        fprintf(F, "%s %llx %zu", P.first.c_str(),
+                (unsigned long long)TheSession->CounterShapes[P.first], P.second.size());
+        for (uint64_t C : P.second)
+            fprintf(F, " %llu", (unsigned long long)C);
+        fprintf(F, "\n");
+    }
+    fclose(F);
+}
+
+static void ReadProfile()
+{
+    std::ifstream In(TheSession->Opts.ProfileUse);
+    if (!In)
+    {
+        fprintf(stderr, "Cannot read profile %s\n", TheSession->Opts.ProfileUse.c_str());
+        return;
+    }
+
+    std::string Name;
+    if (!std::getline(In, Name) || Name != ProfileHeader)
+    {
+        fprintf(stderr, "Profile %s is not in the current format; regenerate it with -pgo-gen\n",
+                TheSession->Opts.ProfileUse.c_str());
+        return;
+    }
+
+    uint64_t Shape;
+    size_t N;
+    uint64_t MaxEntry = 0;
+    while (In >> Name >> std::hex >> Shape >> std::dec >> N)
+    {
+        TheSession->LoadedShapes[Name] = Shape;
+        auto &Counts = TheSession->LoadedProfile[Name];
+        Counts.resize(N);
+        for (auto &C : Counts)
+            In >> C;
+        if (N)
+            MaxEntry = std::max(MaxEntry, Counts[0]);
+    }
+
+    // Functions entered at least a tenth as often as the hottest one are hot.
+    TheSession->ProfileHotCount = std::max<uint64_t>(MaxEntry / 10, 1);
+}
+
+static llvm::Type *getLLVMType(ValType Ty)
+{
+    switch (Ty)
+    {
+        case type_bool:
+            return llvm::Type::getInt1Ty(TheSession->TheContext);
+        case type_i32:
+            return llvm::Type::getInt32Ty(TheSession->TheContext);
+        case type_i64:
+            return llvm::Type::getInt64Ty(TheSession->TheContext);
+        case type_f32:
+            return llvm::Type::getFloatTy(TheSession->TheContext);
+        case type_f64:
+            return llvm::Type::getDoubleTy(TheSession->TheContext);
+
+        case type_i32_array:
+            return llvm::Type::getInt32PtrTy(TheSession->TheContext);
+        case type_i64_array:
+            return llvm::Type::getInt64PtrTy(TheSession->TheContext);
+        case type_f32_array:
+            return llvm::Type::getFloatPtrTy(TheSession->TheContext);
+        case type_f64_array:
+            return llvm::Type::getDoublePtrTy(TheSession->TheContext);
+    }
+    llvm_unreachable("Unknown ValType");
+}
+
+// bool < i32 < i64 < f32 < f64
+static unsigned getTypeRank(llvm::Type *Ty)
+{
+    if (Ty->isDoubleTy())
+        return 4;
+    if (Ty->isFloatTy())
+        return 3;
+    if (Ty->isIntegerTy(64))
+        return 2;
+    if (Ty->isIntegerTy(32))
+        return 1;
+    return 0;
+}
+
+// Implicit conversion between value types. Conversions to bool test != 0.
+// Arrays do not convert to anything.
+static llvm::Value *CastTo(llvm::Value *V, llvm::Type *DestTy)
+{
+    llvm::Type *SrcTy = V->getType();
+    if (SrcTy == DestTy)
+        return V;
+
+    if (SrcTy->isPointerTy() || DestTy->isPointerTy())
+        return LogErrorV("Array type mismatch");
+
+    if (DestTy->isIntegerTy(1))
+    {
+        if (SrcTy->isFloatingPointTy())
+            return TheSession->Builder->CreateFCmpUNE(V, llvm::ConstantFP::get(SrcTy, 0.0), "tobool");
+        return TheSession->Builder->CreateICmpNE(V, llvm::ConstantInt::get(SrcTy, 0), "tobool");
+    }
+
+    if (SrcTy->isIntegerTy())
+    {
+        bool IsBool = SrcTy->isIntegerTy(1);
+        if (DestTy->isIntegerTy())
+            return IsBool ? TheSession->Builder->CreateZExt(V, DestTy, "conv")
+                          : TheSession->Builder->CreateSExtOrTrunc(V, DestTy, "conv");
+        return IsBool ? TheSession->Builder->CreateUIToFP(V, DestTy, "conv")
+                      : TheSession->Builder->CreateSIToFP(V, DestTy, "conv");
+    }
+
+    if (DestTy->isIntegerTy())
+        return TheSession->Builder->CreateFPToSI(V, DestTy, "conv");
+
+    return TheSession->Builder->CreateFPCast(V, DestTy, "conv");
+}
+
+static llvm::Value *EmitExpr(const ExprPool &P, ExprId E);
+
+// Whether literal E can take type Ty without changing its value: it has no
+// fractional part and fits Ty (0 or 1 for bool). fptosi of a constant out
+// of range folds to poison.
+static bool IsAdaptableLiteral(const ExprPool &P, ExprId E, llvm::Type *Ty)
+{
+    if (P[E].Kind != ek_number)
+        return false;
+    double Val = P.getLiteral(P[E]);
+    if (Ty->isFloatingPointTy())
+        return true;
+    if (Val != std::trunc(Val))
+        return false;
+    if (Ty->isIntegerTy(1))
+        return Val == 0 || Val == 1;
+
+    double Limit = std::ldexp(1.0, Ty->getIntegerBitWidth() - 1);
+    return Val >= -Limit && Val < Limit;
+}
+
+// Type two values meet at (operands, if branches): a literal takes the
+// other value's type, otherwise the wider one wins.
+static llvm::Type *getCommonType(const ExprPool &P, ExprId LHS, llvm::Value *L,
+                                 ExprId RHS, llvm::Value *R)
+{
+    bool LIsLit = IsAdaptableLiteral(P, LHS, R->getType());
+    bool RIsLit = IsAdaptableLiteral(P, RHS, L->getType());
+
+    if (LIsLit && !RIsLit)
+        return R->getType();
+    if (RIsLit && !LIsLit)
+        return L->getType();
+    return getTypeRank(L->getType()) >= getTypeRank(R->getType()) ? L->getType()
+                                                                   : R->getType();
+}
+
+static llvm::Value *EmitNumber(const ExprPool &P, const ExprNode &N)
+{
+    return llvm::ConstantFP::get(TheSession->TheContext, llvm::APFloat(P.getLiteral(N)));
+}
+
+
+// Locals live in entry-block allocas; mem2reg turns them into registers.
+static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction,
+                                                const std::string &VarName,
+                                                llvm::Type *Ty)
+{
+    llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                           TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+static llvm::Value *EmitVariable(const ExprPool &P, const ExprNode &N)
+{
+    const std::string &Name = P.getName(N.Name);
+    auto *A = TheSession->NamedValues[Name];
+    if (!A)
+        return LogErrorV("Unknown variable name");
+    return TheSession->Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+}
+
+static llvm::Value *EmitIndexAddress(const ExprPool &P, const ExprNode &N)
+{
+    const std::string &Name = P.getName(N.Name);
+    auto *A = TheSession->NamedValues[Name];
+    if (!A)
+        return LogErrorV("Unknown variable name");
+    if (!A->getAllocatedType()->isPointerTy())
+        return LogErrorV("Only arrays can be indexed");
+
+    llvm::Value *Base = TheSession->Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+
+    llvm::Value *Idx = EmitExpr(P, N.Kid[0]);
+    if (!Idx)
+        return nullptr;
+    Idx = CastTo(Idx, llvm::Type::getInt64Ty(TheSession->TheContext));
+    if (!Idx)
+        return nullptr;
+
+    return TheSession->Builder->CreateInBoundsGEP(Base->getType()->getPointerElementType(),
+                                      Base, Idx, "eltaddr");
+}
+
+static llvm::Value *EmitIndex(const ExprPool &P, const ExprNode &N)
+{
+    llvm::Value *Addr = EmitIndexAddress(P, N);
+    if (!Addr)
+        return nullptr;
+    return TheSession->Builder->CreateLoad(Addr->getType()->getPointerElementType(), Addr, "elt");
+}
+
+// Stores Val, the already generated RHS of an '=', to its destination.
+static llvm::Value *EmitAssign(const ExprPool &P, const ExprNode &N, llvm::Value *Val)
+{
+    llvm::Value *Addr = nullptr;
+    const ExprNode &Dest = P[N.Kid[0]];
+    if (Dest.Kind == ek_variable)
+    {
+        Addr = TheSession->NamedValues[P.getName(Dest.Name)];
+        if (!Addr)
+            return LogErrorV("Unknown variable name");
+    }
+    else if (Dest.Kind == ek_index)
+    {
+        Addr = EmitIndexAddress(P, Dest);
+        if (!Addr)
+            return nullptr;
+    }
+    else
+        return LogErrorV("destination of '=' must be a variable or an array element");
+
+    Val = CastTo(Val, Addr->getType()->getPointerElementType());
+    if (!Val)
+        return nullptr;
+    TheSession->Builder->CreateStore(Val, Addr);
+    return Val;
+}
+
+static llvm::Value *EmitBinaryOp(const ExprPool &P, const ExprNode &N,
+                                llvm::Value *L, llvm::Value *R)
+{
+    char Op = N.Op;
+    if (Op == ':')  // sequencing, evaluates to the RHS
+        return R;
+
+    if (L->getType()->isPointerTy() || R->getType()->isPointerTy())
+        return LogErrorV("Arrays can only be indexed");
+
+    // bool is promoted to i32 like in C.
+    llvm::Type *Ty = getCommonType(P, N.Kid[0], L, N.Kid[1], R);
+    if (Ty->isIntegerTy(1))
+        Ty = llvm::Type::getInt32Ty(TheSession->TheContext);
+
+    L = CastTo(L, Ty);
+    R = CastTo(R, Ty);
+
+    if (Ty->isIntegerTy())
+    {
+        switch (Op)
+        {
+            case '+':
+                return TheSession->Builder->CreateAdd(L, R, "addtmp");
+            case '-':
+                return TheSession->Builder->CreateSub(L, R, "subtmp");
+            case '*':
+                return TheSession->Builder->CreateMul(L, R, "multmp");
+            case '<':
+                return TheSession->Builder->CreateICmpSLT(L, R, "cmptmp");
+
+            default:
+                return LogErrorV("Invalid operator");
+        }
+    }
+
+    switch (Op)
+    {
+        case '+':
+            return TheSession->Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return TheSession->Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return TheSession->Builder->CreateFMul(L, R, "multmp");
+        case '<':
+            return TheSession->Builder->CreateFCmpULT(L, R, "cmptmp");
+        
+        default:
+            return LogErrorV("Invalid operator");
+    }
+}
+
+// Post-order walk over nested binary nodes with an explicit stack, so
+// operator chains of any depth are emitted in bounded native stack; other
+// operands go through EmitExpr. Operands are evaluated left to right,
+// except that '=' evaluates its value before the destination.
+static llvm::Value *EmitBinary(const ExprPool &P, ExprId Root)
+{
+    struct Frame
+    {
+        ExprId E;
+        int Visited;        // operands generated so far
+        llvm::Value *First; // value of the first one
+    };
+    std::vector<Frame> Stack;
+    Stack.push_back({Root, 0, nullptr});
+
+    llvm::Value *Result = nullptr;
+    while (true)
+    {
+        Frame &F = Stack.back();
+        const ExprNode &N = P[F.E];
+        bool IsAssign = N.Op == '=';
+        if (F.Visited < (IsAssign ? 1 : 2))
+        {
+            ExprId Next = (IsAssign || F.Visited == 1) ? N.Kid[1] : N.Kid[0];
+            if (P[Next].Kind == ek_binary)
+            {
+                Stack.push_back({Next, 0, nullptr});
+                continue;
+            }
+
+            Result = EmitExpr(P, Next);
+            if (!Result)
+                return nullptr;
+        }
+        else
+        {
+            Result = IsAssign ? EmitAssign(P, N, F.First)
+                              : EmitBinaryOp(P, N, F.First, Result);
+            Stack.pop_back();
+            if (!Result || Stack.empty())
+                return Result;
+        }
+
+        // Result is the value of an operand of the node on top.
+        Frame &Parent = Stack.back();
+        if (Parent.Visited++ == 0)
+            Parent.First = Result;
+    }
+}
+
+
+/* Purity
+ *
+ * Once a definition is optimized we look at what it does. No stores and
+ * no calls to functions that write memory makes it readonly; no loads on
+ * top of that makes it readnone, i.e. its result depends on its arguments
+ * only. Externs are assumed to do anything. The effects are recorded by
+ * name, so declarations of the function in later modules carry them too,
+ * and GVN/LICM in callers can merge and hoist the calls.
+ *
+ * A caller's effects hold only as long as its callees' do. Code linked
+ * later binds to the newest definition of a name, so redefining a function
+ * drops the effects of every definition inferred through it, transitively.
+ */
+
+static void ApplyEffects(llvm::Function *F, const FunctionEffects &E)
+{
+    F->removeFnAttr(llvm::Attribute::ReadNone);
+    F->removeFnAttr(llvm::Attribute::ReadOnly);
+
+    if (E.ReadNone)
+        F->addFnAttr(llvm::Attribute::ReadNone);
+    else if (E.ReadOnly)
+        F->addFnAttr(llvm::Attribute::ReadOnly);
+    if (E.NoUnwind)
+        F->addFnAttr(llvm::Attribute::NoUnwind);
+    if (E.WillReturn)
+        F->addFnAttr(llvm::Attribute::WillReturn);
+}
+
+// Forget the effects of every definition inferred through Name.
+static void InvalidateCallerEffects(const std::string &Name)
+{
+    std::vector<std::string> Work = {Name};
+    while (!Work.empty())
+    {
+        std::string Callee = std::move(Work.back());
+        Work.pop_back();
+
+        for (auto &D : TheSession->EffectCallees)
+            if (D.second.count(Callee) && TheSession->InferredEffects.erase(D.first))
+                Work.push_back(D.first);
+    }
+}
+
+static void InferEffects(llvm::Function *F)
+{
+    FunctionEffects E = {true, true, true, true};
+
+    for (auto &BB : *F)
+        for (auto &I : BB)
+        {
+            auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+            if (!CI)
+            {
+                if (I.mayWriteToMemory())
+                    E.ReadNone = E.ReadOnly = false;
+                else if (I.mayReadFromMemory())
+                    E.ReadNone = false;
+                continue;
+            }
+
+            llvm::Function *Callee = CI->getCalledFunction();
+            if (Callee == F)    // recursion adds no effects, but may not end
+            {
+                E.WillReturn = false;
+                continue;
+            }
+            if (!Callee->isIntrinsic())
+                TheSession->EffectCallees[F->getName().str()].insert(Callee->getName().str());
+
+            if (!Callee->doesNotAccessMemory())
+            {
+                E.ReadNone = false;
+                if (!Callee->onlyReadsMemory())
+                    E.ReadOnly = false;
+            }
+            if (!Callee->doesNotThrow())
+                E.NoUnwind = false;
+            if (!Callee->isIntrinsic() && !Callee->hasFnAttribute(llvm::Attribute::WillReturn))
+                E.WillReturn = false;
+        }
+
+    // Neither may loops
+    llvm::SmallVector<std::pair<const llvm::BasicBlock*, const llvm::BasicBlock*>, 4> BackEdges;
+    llvm::FindFunctionBackedges(*F, BackEdges);
+    if (!BackEdges.empty())
+        E.WillReturn = false;
+
+    ApplyEffects(F, E);
+    TheSession->InferredEffects[F->getName().str()] = E;
+}
+
+
+// Get the function from the current module, or re-declare it there from
+// FunctionProtos if it was emitted into an earlier (already JIT'd) module.
+static llvm::Function *getFunction(const std::string &Name)
+{
+    if (auto *F = TheSession->TheModule->getFunction(Name))
+        return F;
+
+    auto FI = TheSession->FunctionProtos.find(Name);
+    if (FI == TheSession->FunctionProtos.end())
+        return nullptr;
+
+    llvm::Function *F = FI->second->codegen();
+    auto EI = TheSession->InferredEffects.find(Name);
+    if (EI != TheSession->InferredEffects.end())
+        ApplyEffects(F, EI->second);
+    return F;
+}
+
+
+/* Math builtins
+ *
+ * An extern of a known libm function with the matching signature (all f64,
+ * or all f32 for the "f"-suffixed name) is called through the LLVM
+ * intrinsic instead, which is readnone, constant-folds, lowers to single
+ * instructions where the target has them, and vectorizes. Defining a
+ * function of the same name turns this off for it.
+ */
+static const struct
+{
+    const char *Name;
+    llvm::Intrinsic::ID ID;
+    unsigned NumArgs;
+} MathIntrinsics[] = {
+    {"sin", llvm::Intrinsic::sin, 1},
+    {"cos", llvm::Intrinsic::cos, 1},
+    {"sqrt", llvm::Intrinsic::sqrt, 1},
+    {"exp", llvm::Intrinsic::exp, 1},
+    {"exp2", llvm::Intrinsic::exp2, 1},
+    {"log", llvm::Intrinsic::log, 1},
+    {"log2", llvm::Intrinsic::log2, 1},
+    {"log10", llvm::Intrinsic::log10, 1},
+    {"fabs", llvm::Intrinsic::fabs, 1},
+    {"floor", llvm::Intrinsic::floor, 1},
+    {"ceil", llvm::Intrinsic::ceil, 1},
+    {"trunc", llvm::Intrinsic::trunc, 1},
+    {"round", llvm::Intrinsic::round, 1},
+    {"pow", llvm::Intrinsic::pow, 2},
+    {"fmin", llvm::Intrinsic::minnum, 2},
+    {"fmax", llvm::Intrinsic::maxnum, 2},
+    {"copysign", llvm::Intrinsic::copysign, 2},
+    {"fma", llvm::Intrinsic::fma, 3},
+};
+
+
+static void RecognizeMathBuiltin(llvm::Function *F)
+{
+    std::string Name = F->getName().str();
+    llvm::FunctionType *FT = F->getFunctionType();
+    llvm::Type *Ty = FT->getReturnType();
+
+    for (auto &MI : MathIntrinsics)
+    {
+        bool IsF32 = Name == std::string(MI.Name) + "f";
+        if (Name != MI.Name && !IsF32)
+            continue;
+
+        if (Ty != (IsF32 ? llvm::Type::getFloatTy(TheSession->TheContext)
+                         : llvm::Type::getDoubleTy(TheSession->TheContext)) ||
+            FT->getNumParams() != MI.NumArgs)
+            return;
+        for (llvm::Type *ParamTy : FT->params())
+            if (ParamTy != Ty)
+                return;
+
+        TheSession->MathBuiltins[Name] = std::make_pair(MI.ID, Ty);
+        return;
+    }
+}
+
+static llvm::Function *getMathBuiltin(const std::string &Name)
+{
+    auto BI = TheSession->MathBuiltins.find(Name);
+    if (BI == TheSession->MathBuiltins.end())
+        return nullptr;
+    return llvm::Intrinsic::getDeclaration(TheSession->TheModule.get(), BI->second.first,
+                                           {BI->second.second});
+}
+
+
+/* Booleans cross calls as i1. Unless an i1 parameter or result is marked
+ * zeroext, the bits above bit 0 of its register are undefined, while C++
+ * hosts calling through lookup<bool(...)> read all of al. Calls carry the
+ * same attributes as the callee.
+ */
+template <typename T>
+static void AddBoolExtAttrs(T *FnOrCall, llvm::FunctionType *FT)
+{
+    for (unsigned i = 0, e = FT->getNumParams(); i != e; ++i)
+        if (FT->getParamType(i)->isIntegerTy(1))
+            FnOrCall->addParamAttr(i, llvm::Attribute::ZExt);
+    if (FT->getReturnType()->isIntegerTy(1))
+        FnOrCall->addAttribute(llvm::AttributeList::ReturnIndex, llvm::Attribute::ZExt);
+}
+
+static llvm::Value *EmitCall(const ExprPool &P, const ExprNode &N)
+{
+    const std::string &Callee = P.getName(N.Name);
+    auto Args = P.getArgs(N);
+
+    llvm::Function *CalleeF = getMathBuiltin(Callee);
+    if (!CalleeF)
+        CalleeF = getFunction(Callee);
+    if (!CalleeF)
+        return LogErrorV("Unknown function referenced");
+
+    if (CalleeF->arg_size() != Args.size())
+        return LogErrorV("Incorrect number of args");
+
+    std::vector<llvm::Value *> ArgsV;
+    for (unsigned i=0, e = Args.size(); i != e; ++i)
+    {
+        llvm::Value *Arg = EmitExpr(P, Args[i]);
+        if (Arg)
+            Arg = CastTo(Arg, CalleeF->getFunctionType()->getParamType(i));
+        if (!Arg)
+            return nullptr;
+        ArgsV.push_back(Arg);
+    }
+
+    uint64_t Count = EmitProfileCounter();
+    auto *Call = TheSession->Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    AddBoolExtAttrs(Call, CalleeF->getFunctionType());
+
+    // Self-calls whose value is the function's result feed tail-recursion
+    // elimination.
+    llvm::Function *Caller = TheSession->Builder->GetInsertBlock()->getParent();
+    if ((N.Flags & ef_tail) && CalleeF == Caller)
+        Call->setTailCall();
+
+    // A call site that never ran while its caller did is cold, which lets
+    // hot/cold splitting move it out of the way.
+    auto EntryCount = Caller->getEntryCount();
+    if (HasProfile(Caller->getName().str()) && Count == 0 &&
+        EntryCount.hasValue() && EntryCount.getCount() > 0)
+        Call->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::Cold);
+
+    return Call;
+}
+
+
+static llvm::Value *EmitIf(const ExprPool &P, const ExprNode &N)
+{
+    ExprId Then = N.Kid[1], Else = N.Kid[2];
+
+    llvm::Value *CondV = EmitExpr(P, N.Kid[0]);
+    if (CondV)
+        CondV = CastTo(CondV, llvm::Type::getInt1Ty(TheSession->TheContext));
+    if (!CondV)
+        return nullptr;
+
+    llvm::Function *TheFunction = TheSession->Builder->GetInsertBlock()->getParent();
+
+    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(TheSession->TheContext, "then", TheFunction);
+    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(TheSession->TheContext, "else", TheFunction);
+    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(TheSession->TheContext, "ifcont", TheFunction);
+    auto *CondBr = TheSession->Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+    TheSession->Builder->SetInsertPoint(ThenBB);
+    uint64_t ThenCount = EmitProfileCounter();
+    llvm::Value *ThenV = EmitExpr(P, Then);
+    if (!ThenV)
+        return nullptr;
+    ThenBB = TheSession->Builder->GetInsertBlock();   // codegen of Then can change the block
+
+    TheSession->Builder->SetInsertPoint(ElseBB);
+    uint64_t ElseCount = EmitProfileCounter();
+    llvm::Value *ElseV = EmitExpr(P, Else);
+    if (!ElseV)
+        return nullptr;
+    ElseBB = TheSession->Builder->GetInsertBlock();
+
+    if (HasProfile(TheFunction->getName().str()))
+        CondBr->setMetadata(llvm::LLVMContext::MD_prof, getBranchWeights(ThenCount, ElseCount));
+
+    // Both branches are still open, so each can convert its value to the
+    // common type before jumping to the merge block.
+    llvm::Type *Ty = getCommonType(P, Then, ThenV, Else, ElseV);
+
+    TheSession->Builder->SetInsertPoint(ThenBB);
+    ThenV = CastTo(ThenV, Ty);
+    TheSession->Builder->CreateBr(MergeBB);
+
+    TheSession->Builder->SetInsertPoint(ElseBB);
+    ElseV = CastTo(ElseV, Ty);
+    TheSession->Builder->CreateBr(MergeBB);
+
+    if (!ThenV || !ElseV)
+        return nullptr;
+
+    TheSession->Builder->SetInsertPoint(MergeBB);
+    llvm::PHINode *PN = TheSession->Builder->CreatePHI(Ty, 2, "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+static llvm::Value *EmitFor(const ExprPool &P, const ExprNode &N)
+{
+    const std::string &VarName = P.getName(N.Name);
+
+    llvm::Value *StartVal = EmitExpr(P, N.Kid[0]);
+    if (!StartVal)
+        return nullptr;
+    if ((N.Flags & ef_typed) && !(StartVal = CastTo(StartVal, getLLVMType(N.Type))))
+        return nullptr;
+
+    llvm::Type *Ty = StartVal->getType();
+    if (Ty->isPointerTy())
+        return LogErrorV("Loop variable cannot be an array");
+
+    llvm::Function *TheFunction = TheSession->Builder->GetInsertBlock()->getParent();
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, Ty);
+    TheSession->Builder->CreateStore(StartVal, Alloca);
+
+    uint64_t Entered = EmitProfileCounter();
+
+    llvm::BasicBlock *CondBB = llvm::BasicBlock::Create(TheSession->TheContext, "loopcond", TheFunction);
+    llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(TheSession->TheContext, "loop", TheFunction);
+    llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(TheSession->TheContext, "afterloop", TheFunction);
+    TheSession->Builder->CreateBr(CondBB);
+
+    // The loop variable shadows any outer one while the loop is emitted.
+    llvm::AllocaInst *OldVal = TheSession->NamedValues[VarName];
+    TheSession->NamedValues[VarName] = Alloca;
+
+    TheSession->Builder->SetInsertPoint(CondBB);
+    llvm::Value *EndCond = EmitExpr(P, N.Kid[1]);
+    if (EndCond)
+        EndCond = CastTo(EndCond, llvm::Type::getInt1Ty(TheSession->TheContext));
+    if (!EndCond)
+        return nullptr;
+    auto *CondBr = TheSession->Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+
+    TheSession->Builder->SetInsertPoint(LoopBB);
+    uint64_t Iterations = EmitProfileCounter();
+
+    if (!EmitExpr(P, N.Kid[3]))
+        return nullptr;
+
+    llvm::Value *StepVal = N.Kid[2] != NoExpr ? EmitExpr(P, N.Kid[2])
+                                              : llvm::ConstantFP::get(TheSession->TheContext, llvm::APFloat(1.0));
+    if (StepVal)
+        StepVal = CastTo(StepVal, Ty);
+    if (!StepVal)
+        return nullptr;
+
+    llvm::Value *CurVar = TheSession->Builder->CreateLoad(Ty, Alloca, VarName.c_str());
+    llvm::Value *NextVar = Ty->isIntegerTy() ? TheSession->Builder->CreateAdd(CurVar, StepVal, "nextvar")
+                                             : TheSession->Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    TheSession->Builder->CreateStore(NextVar, Alloca);
+    TheSession->Builder->CreateBr(CondBB);
+
+    if (HasProfile(TheFunction->getName().str()))
+        CondBr->setMetadata(llvm::LLVMContext::MD_prof, getBranchWeights(Iterations, Entered));
+
+    TheSession->Builder->SetInsertPoint(AfterBB);
+
+    if (OldVal)
+        TheSession->NamedValues[VarName] = OldVal;
+    else
+        TheSession->NamedValues.erase(VarName);
+
+    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(TheSession->TheContext));
+}
+
+static llvm::Value *EmitVar(const ExprPool &P, const ExprNode &N)
+{
+    llvm::Function *TheFunction = TheSession->Builder->GetInsertBlock()->getParent();
+    auto Vars = P.getBindings(N);
+    std::vector<llvm::AllocaInst*> OldBindings;
+
+    for (auto &Var : Vars)
+    {
+        const std::string &Name = P.getName(Var.Name);
+
+        // Initializers are evaluated before the variable is in scope, so
+        // "var a = a in ..." refers to an outer a.
+        llvm::Value *InitVal = nullptr;
+        if (Var.Init != NoExpr)
+        {
+            InitVal = EmitExpr(P, Var.Init);
+            if (InitVal && Var.HasType)
+                InitVal = CastTo(InitVal, getLLVMType(Var.Type));
+            if (!InitVal)
+                return nullptr;
+        }
+        else
+            InitVal = llvm::Constant::getNullValue(getLLVMType(Var.Type));
+
+        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Name, InitVal->getType());
+        TheSession->Builder->CreateStore(InitVal, Alloca);
+
+        OldBindings.push_back(TheSession->NamedValues[Name]);
+        TheSession->NamedValues[Name] = Alloca;
+    }
+
+    llvm::Value *BodyVal = EmitExpr(P, N.Kid[2]);
+
+    for (unsigned i = 0, e = Vars.size(); i != e; ++i)
+    {
+        const std::string &Name = P.getName(Vars[i].Name);
+        if (OldBindings[i])
+            TheSession->NamedValues[Name] = OldBindings[i];
+        else
+            TheSession->NamedValues.erase(Name);
+    }
+
+    return BodyVal;
+}
+
+static llvm::Value *EmitExpr(const ExprPool &P, ExprId E)
+{
+    const ExprNode &N = P[E];
+    switch (N.Kind)
+    {
+    case ek_number:
+        return EmitNumber(P, N);
+    case ek_variable:
+        return EmitVariable(P, N);
+    case ek_index:
+        return EmitIndex(P, N);
+    case ek_binary:
+        return EmitBinary(P, E);
+    case ek_call:
+        return EmitCall(P, N);
+    case ek_if:
+        return EmitIf(P, N);
+    case ek_for:
+        return EmitFor(P, N);
+    case ek_var:
+        return EmitVar(P, N);
+    }
+    return LogErrorV("Unknown expression");
+}
+
+llvm::FunctionType *PrototypeAST::getFunctionType() const
+{
+    std::vector<llvm::Type*> ArgTys;
+    for (ValType Ty : ArgTypes)
+        ArgTys.push_back(getLLVMType(Ty));
+
+    return llvm::FunctionType::get(getLLVMType(RetType), ArgTys, false);
+}
+
+std::string PrototypeAST::getSignature() const
+{
+    static const char *const TypeNames[] = {
+        "bool", "i32", "i64", "f32", "f64", "i32[]", "i64[]", "f32[]", "f64[]"
+    };
+
+    std::string Sig = std::string(TypeNames[RetType]) + "(";
+    for (size_t i = 0; i < ArgTypes.size(); ++i)
+        Sig += std::string(i ? "," : "") + TypeNames[ArgTypes[i]];
+    return Sig + ")";
+}
+
+llvm::Function *PrototypeAST::codegen()
+{
+    llvm::FunctionType* FT = getFunctionType();
+    
+    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, 
+                                                Name, TheSession->TheModule.get());
+
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(Args[Idx++]);
+    AddBoolExtAttrs(F, FT);
+    
+    return F;
+}
+
+
+
+/* Memoization
+ *
+ * "memo def f(...)" compiles the body into a private f.impl, and f becomes a
+ * wrapper that looks its arguments up in a direct-mapped cache on the host
+ * before calling f.impl. Recursive calls go through f, so they hit the cache
+ * as well. Arguments and results are stored as their bit patterns widened
+ * to i64.
+ */
+namespace {
+struct MemoCache
+{
+    std::string Name;
+    unsigned NumArgs;
+    uint64_t Mask;
+    uint64_t Hits = 0, Misses = 0;
+    // Per entry: valid flag, NumArgs argument words, result word.
+    std::unique_ptr<uint64_t[]> Slots;
+};
+} // namespace
+
+static MemoCache *CreateMemoCache(const std::string &Name, unsigned NumArgs)
+{
+    uint64_t Entries = llvm::PowerOf2Ceil(std::max(1u, TheSession->Opts.MemoEntries));
+
+    auto *C = new MemoCache;
+    C->Name = Name;
+    C->NumArgs = NumArgs;
+    C->Mask = Entries - 1;
+    C->Slots.reset(new uint64_t[Entries * (NumArgs + 2)]());
+    TheSession->MemoCaches.push_back(std::unique_ptr<MemoCache>(C));
+    return C;
+}
+
+static llvm::Value *ToBits(llvm::Value *V)
+{
+    llvm::Type *Ty = V->getType();
+    if (Ty->isFloatingPointTy())
+        V = TheSession->Builder->CreateBitCast(V, TheSession->Builder->getIntNTy(Ty->getScalarSizeInBits()));
+    return TheSession->Builder->CreateZExt(V, TheSession->Builder->getInt64Ty());
+}
+
+static llvm::Value *FromBits(llvm::Value *Bits, llvm::Type *Ty)
+{
+    if (!Ty->isFloatingPointTy())
+        return TheSession->Builder->CreateTrunc(Bits, Ty);
+    Bits = TheSession->Builder->CreateTrunc(Bits, TheSession->Builder->getIntNTy(Ty->getScalarSizeInBits()));
+    return TheSession->Builder->CreateBitCast(Bits, Ty);
+}
+
+static void EmitMemoWrapper(llvm::Function *F, llvm::Function *Impl, MemoCache *Cache)
+{
+    auto *Int64Ty = TheSession->Builder->getInt64Ty();
+
+    llvm::BasicBlock *EntryBB = llvm::BasicBlock::Create(TheSession->TheContext, "Entry", F);
+    llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(TheSession->TheContext, "hit", F);
+    llvm::BasicBlock *MissBB = llvm::BasicBlock::Create(TheSession->TheContext, "miss", F);
+
+    TheSession->Builder->SetInsertPoint(EntryBB);
+
+    std::vector<llvm::Value*> Args, Keys;
+    llvm::Value *Hash = TheSession->Builder->getInt64(0);
+    for (auto &Arg : F->args())
+    {
+        Args.push_back(&Arg);
+        Keys.push_back(ToBits(&Arg));
+        Hash = TheSession->Builder->CreateXor(Hash, Keys.back());
+        Hash = TheSession->Builder->CreateMul(Hash, TheSession->Builder->getInt64(0x9E3779B97F4A7C15ULL),
+                                              "hash");
+    }
+    Hash = TheSession->Builder->CreateXor(Hash, TheSession->Builder->CreateLShr(Hash, 32), "hash");
+
+    llvm::Value *Index = TheSession->Builder->CreateAnd(Hash, Cache->Mask, "slot");
+    llvm::Value *Entry = TheSession->Builder->CreateInBoundsGEP(
+        Int64Ty, getHostPointer(Cache->Slots.get(), Int64Ty),
+        TheSession->Builder->CreateMul(Index, TheSession->Builder->getInt64(Cache->NumArgs + 2)), "entry");
+    auto Word = [&](unsigned i) {
+        return TheSession->Builder->CreateConstInBoundsGEP1_64(Int64Ty, Entry, i);
+    };
+
+    llvm::Value *Hit = TheSession->Builder->CreateICmpNE(TheSession->Builder->CreateLoad(Int64Ty, Word(0)),
+                                             TheSession->Builder->getInt64(0), "valid");
+    for (unsigned i = 0; i != Cache->NumArgs; ++i)
+        Hit = TheSession->Builder->CreateAnd(Hit, TheSession->Builder->CreateICmpEQ(
+                  TheSession->Builder->CreateLoad(Int64Ty, Word(i + 1)), Keys[i]), "match");
+    TheSession->Builder->CreateCondBr(Hit, HitBB, MissBB);
+
+    TheSession->Builder->SetInsertPoint(HitBB);
+    EmitHostIncrement(&Cache->Hits, "memo.hits");
+    llvm::Value *Cached = TheSession->Builder->CreateLoad(Int64Ty, Word(Cache->NumArgs + 1), "cached");
+    TheSession->Builder->CreateRet(FromBits(Cached, F->getReturnType()));
+
+    TheSession->Builder->SetInsertPoint(MissBB);
+    EmitHostIncrement(&Cache->Misses, "memo.misses");
+    auto *Result = TheSession->Builder->CreateCall(Impl, Args, "result");
+    AddBoolExtAttrs(Result, Impl->getFunctionType());
+    for (unsigned i = 0; i != Cache->NumArgs; ++i)
+        TheSession->Builder->CreateStore(Keys[i], Word(i + 1));
+    TheSession->Builder->CreateStore(ToBits(Result), Word(Cache->NumArgs + 1));
+    TheSession->Builder->CreateStore(TheSession->Builder->getInt64(1), Word(0));
+    TheSession->Builder->CreateRet(Result);
+}
+
+static void PrintMemoStats()
+{
+    for (auto &C : TheSession->MemoCaches)
+        fprintf(stderr, "memo %s: %llu hits, %llu misses\n", C->Name.c_str(),
+                (unsigned long long)C->Hits, (unsigned long long)C->Misses);
+}
+
+
+/* Dumps
+ *
+ * Nothing is printed while compiling unless asked for: Verbosity names each
+ * item (1) and prints its IR after the function passes (2), and the Dump*
+ * options print a definition's IR before its passes, its module as it goes
+ * to the JIT and its assembly, for the definitions in DumpFunctions (all if
+ * it is empty). Printing IR costs more than compiling it, so every dump is
+ * checked for before anything is formatted.
+ */
+
+static llvm::TargetMachine &getTargetMachine();
+
+static llvm::raw_ostream &DumpStream()
+{
+    return TheSession->DumpOS ? *TheSession->DumpOS : llvm::errs();
+}
+
+static bool ShouldDump(bool Enabled, llvm::StringRef Name)
+{
+    auto &Names = TheSession->Opts.DumpFunctions;
+    return Enabled && (Names.empty() || llvm::is_contained(Names, Name));
+}
+
+// "Read <What>: <name>", and its IR with Verbosity 2 and up.
+static void ReportItem(const char *What, llvm::Function *FnIR)
+{
+    unsigned Verbosity = TheSession->Opts.Verbosity;
+    if (!Verbosity)
+        return;
+
+    auto &OS = DumpStream();
+    OS << "Read " << What << ": " << FnIR->getName() << "\n";
+    if (Verbosity >= 2)
+    {
+        FnIR->print(OS);
+        OS << "\n";
+    }
+}
+
+// TheModule after the module passes, and the assembly the JIT will make of
+// it, if they are wanted for Name.
+static void DumpModule(llvm::StringRef Name)
+{
+    auto &OS = DumpStream();
+
+    if (ShouldDump(TheSession->Opts.DumpIRAfter, Name))
+    {
+        OS << "; IR of " << Name << " after passes\n";
+        TheSession->TheModule->print(OS, nullptr);
+    }
+
+    if (ShouldDump(TheSession->Opts.DumpAsm, Name))
+    {
+        // Code generation changes the IR it runs on; the JIT gets the original.
+        auto M = llvm::CloneModule(*TheSession->TheModule);
+        llvm::SmallString<4096> Asm;
+        llvm::raw_svector_ostream AsmOS(Asm);
+        llvm::legacy::PassManager PM;
+        if (getTargetMachine().addPassesToEmitFile(PM, AsmOS, nullptr, llvm::CGFT_AssemblyFile))
+        {
+            OS << "; cannot emit assembly for this target\n";
+            return;
+        }
+        PM.run(*M);
+        OS << "; assembly of " << Name << "\n" << Asm << "\n";
+    }
+}
+
+
+/* Call statistics
+ *
+ * With CallStats set, the body of "def f" is compiled into a private
+ * f.counted, and f becomes a wrapper that counts the call and reads the
+ * cycle counter (rdtsc on x86) around it. Calls f.counted makes to itself
+ * (and, for memo functions, to its cache) skip the wrapper, so recursion is
+ * part of the call that started it and still becomes a loop. Only the
+ * outermost call in progress adds its cycles, so mutual recursion is not
+ * counted twice either. Counters are kept by name, on the host: a
+ * redefinition adds to its predecessor's.
+ */
+
+static CallCounters *GetCallCounters(const std::string &Name)
+{
+    std::lock_guard<std::mutex> Guard(TheSession->CallStats->Lock);
+    return &TheSession->CallStats->Functions[Name];
+}
+
+// Rename F to F.counted and return the wrapper that replaces it. BodyFn is
+// where F's body is (F itself, or its memo implementation).
+static llvm::Function *EmitCallStatsWrapper(llvm::Function *F, llvm::Function *BodyFn)
+{
+    std::string Name = F->getName().str();
+    CallCounters *C = GetCallCounters(Name);
+
+    F->setName(Name + ".counted");
+    F->setLinkage(llvm::Function::InternalLinkage);
+    auto *W = llvm::Function::Create(F->getFunctionType(), llvm::Function::ExternalLinkage,
+                                     Name, TheSession->TheModule.get());
+    AddBoolExtAttrs(W, W->getFunctionType());
+    F->replaceUsesWithIf(W, [&](llvm::Use &U) {
+        auto *I = llvm::dyn_cast<llvm::Instruction>(U.getUser());
+        return !I || (I->getFunction() != F && I->getFunction() != BodyFn);
+    });
+
+    auto &B = *TheSession->Builder;
+    auto *Int64Ty = B.getInt64Ty();
+    auto *ReadCycles = llvm::Intrinsic::getDeclaration(TheSession->TheModule.get(),
+                                                       llvm::Intrinsic::readcyclecounter);
+    auto *Depth = getHostPointer(&C->Depth, Int64Ty);
+    auto *Cycles = getHostPointer(&C->Cycles, Int64Ty);
+
+    B.SetInsertPoint(llvm::BasicBlock::Create(TheSession->TheContext, "Entry", W));
+    EmitHostIncrement(&C->Calls, "calls");
+    llvm::Value *Outer = B.CreateLoad(Int64Ty, Depth, "depth");
+    B.CreateStore(B.CreateAdd(Outer, B.getInt64(1)), Depth);
+    llvm::Value *Start = B.CreateCall(ReadCycles, {}, "start");
+
+    std::vector<llvm::Value*> Args;
+    auto ArgI = F->arg_begin();
+    for (auto &Arg : W->args())
+    {
+        Arg.setName((ArgI++)->getName());
+        Args.push_back(&Arg);
+    }
+    auto *Result = B.CreateCall(F, Args, "result");
+    AddBoolExtAttrs(Result, F->getFunctionType());
+
+    llvm::Value *Elapsed = B.CreateSub(B.CreateCall(ReadCycles, {}, "end"), Start, "elapsed");
+    B.CreateStore(Outer, Depth);
+    Elapsed = B.CreateSelect(B.CreateICmpEQ(Outer, B.getInt64(0)), Elapsed, B.getInt64(0));
+    B.CreateStore(B.CreateAdd(B.CreateLoad(Int64Ty, Cycles, "cycles"), Elapsed), Cycles);
+    B.CreateRet(Result);
+
+    llvm::verifyFunction(*W);
+    return W;
+}
+
+
+// A name's entries in FunctionProtos, InferredEffects and MathBuiltins, so
+// a definition that fails to compile can put back what it replaced.
+struct SavedDeclaration
+{
+    std::string Name;
+    std::shared_ptr<PrototypeAST> Proto;
+    bool HasEffects = false, IsBuiltin = false;
+    FunctionEffects Effects;
+    std::pair<llvm::Intrinsic::ID, llvm::Type*> Builtin;
+};
+
+static SavedDeclaration SaveDeclaration(const std::string &Name)
+{
+    SavedDeclaration S;
+    S.Name = Name;
+
+    auto PI = TheSession->FunctionProtos.find(Name);
+    if (PI != TheSession->FunctionProtos.end())
+        S.Proto = PI->second;
+
+    auto EI = TheSession->InferredEffects.find(Name);
+    S.HasEffects = EI != TheSession->InferredEffects.end();
+    if (S.HasEffects)
+        S.Effects = EI->second;
+
+    auto BI = TheSession->MathBuiltins.find(Name);
+    S.IsBuiltin = BI != TheSession->MathBuiltins.end();
+    if (S.IsBuiltin)
+        S.Builtin = BI->second;
+    return S;
+}
+
+static void RestoreDeclaration(const SavedDeclaration &S)
+{
+    if (S.Proto)
+        TheSession->FunctionProtos[S.Name] = S.Proto;
+    else
+        TheSession->FunctionProtos.erase(S.Name);
+
+    TheSession->InferredEffects.erase(S.Name);
+    if (S.HasEffects)
+        TheSession->InferredEffects[S.Name] = S.Effects;
+
+    TheSession->MathBuiltins.erase(S.Name);
+    if (S.IsBuiltin)
+        TheSession->MathBuiltins[S.Name] = S.Builtin;
+}
+
+llvm::Function* FunctionAST::codegen()
+{
+    TimeScope IRGen(TheSession->Trace.get(), stage_irgen, Proto->getName());
+
+    // Record the prototype so later modules can call this function, then
+    // pick up any extern declaration of it in this module. Effects inferred
+    // for an earlier definition no longer hold; a copy imported for -ipo
+    // (ImportDefinitions) is the definition they were inferred for. If the
+    // definition fails, all of this is undone and the previous one stays in
+    // effect.
+    auto DI = TheSession->FunctionDefs.find(Proto->getName());
+    bool Imported = DI != TheSession->FunctionDefs.end() && DI->second.get() == this;
+    SavedDeclaration Saved = SaveDeclaration(Proto->getName());
+    bool Declared = !TheSession->TheModule->getFunction(Proto->getName());
+    TheSession->FunctionProtos[Proto->getName()] = std::unique_ptr<PrototypeAST>(
+        new PrototypeAST(*Proto)
+    );
+    if (!Imported)
+        TheSession->InferredEffects.erase(Proto->getName());
+    TheSession->MathBuiltins.erase(Proto->getName());
+    llvm::Function* TheFunction = getFunction(Proto->getName());
+
+    // Before the body is emitted: only a declaration made for it here goes.
+    auto Fail = [&](const char *Str) -> llvm::Function* {
+        if (Str)
+            LogErrorV(Str);
+        if (TheFunction && Declared && TheFunction->use_empty())
+            TheFunction->eraseFromParent();
+        RestoreDeclaration(Saved);
+        return nullptr;
+    };
+
+    if (!TheFunction)
+        return Fail(nullptr);
+
+    if (!TheFunction->empty())
+    {
+        Declared = false;
+        return Fail("Function Cannot be redefined");
+    }
+
+    if (TheFunction->getFunctionType() != Proto->getFunctionType())
+        return Fail("Definition does not match its extern declaration");
+
+    // The body goes into TheFunction, or into BodyFn behind a cache wrapper
+    // for memo functions.
+    llvm::Function *BodyFn = TheFunction;
+    if (IsMemo)
+    {
+        for (auto &Arg : TheFunction->args())
+            if (Arg.getType()->isPointerTy())
+                return Fail("memo functions cannot take arrays");
+
+        BodyFn = llvm::Function::Create(TheFunction->getFunctionType(),
+                                        llvm::Function::InternalLinkage,
+                                        Proto->getName() + ".impl", TheSession->TheModule.get());
+        AddBoolExtAttrs(BodyFn, BodyFn->getFunctionType());
+        auto ArgI = TheFunction->arg_begin();
+        for (auto &Arg : BodyFn->args())
+            Arg.setName((ArgI++)->getName());
+
+        if (!Cache)
+            Cache = CreateMemoCache(Proto->getName(), TheFunction->arg_size());
+    }
+
+    llvm::BasicBlock *BB = llvm::BasicBlock::Create(TheSession->TheContext, "Entry", BodyFn);
+    TheSession->Builder->SetInsertPoint(BB);
+
+    TheSession->NamedValues.clear();
+
+    for (auto& Arg: BodyFn->args())
+    {
+        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(BodyFn, Arg.getName().str(), Arg.getType());
+        TheSession->Builder->CreateStore(&Arg, Alloca);
+        TheSession->NamedValues[Arg.getName().str()] = Alloca;
+    }
+
+    // Top-level expressions run once; only definitions are profiled.
+    BeginFunctionProfile(Proto->getName() != "__anon__" ? Proto->getName() : "", Pool);
+    if (!TheSession->ProfileFn.empty())
+    {
+        uint64_t Entry = EmitProfileCounter();
+
+        if (HasProfile(Proto->getName()))
+        {
+            BodyFn->setEntryCount(Entry);
+            if (Entry == 0)
+            {
+                BodyFn->addFnAttr(llvm::Attribute::Cold);
+                BodyFn->addFnAttr(llvm::Attribute::OptimizeForSize);
+            }
+            else if (Entry >= TheSession->ProfileHotCount)
+                BodyFn->addFnAttr(llvm::Attribute::InlineHint);
+        }
+    }
+
+    llvm::Value* RetVal = EmitExpr(Pool, Body);
+    if (RetVal)
+        RetVal = CastTo(RetVal, BodyFn->getReturnType());
+
+    if (RetVal)
+    {
+        TheSession->Builder->CreateRet(RetVal);
+
+        llvm::verifyFunction(*BodyFn);
+        if (IsMemo)
+        {
+            EmitMemoWrapper(TheFunction, BodyFn, Cache);
+            llvm::verifyFunction(*TheFunction);
+        }
+
+        // Opt passes
+        IRGen.stop();
+        if (ShouldDump(TheSession->Opts.DumpIRBefore, Proto->getName()))
+        {
+            DumpStream() << "; IR of " << Proto->getName() << " before passes\n";
+            if (BodyFn != TheFunction)
+                BodyFn->print(DumpStream());
+            TheFunction->print(DumpStream());
+        }
+        TheSession->TheFPM->run(*BodyFn);
+        if (BodyFn != TheFunction)
+            TheSession->TheFPM->run(*TheFunction);
+
+        // A new definition replaces the one its callers' effects were
+        // inferred through. An imported copy keeps the recorded effects, so
+        // they do not depend on which callers happened to import it.
+        if (!Imported)
+        {
+            InvalidateCallerEffects(Proto->getName());
+            TheSession->EffectCallees.erase(Proto->getName());
+            InferEffects(TheFunction);
+        }
+
+        // The wrapper writes its counters, so it is what callers must see
+        // as the definition's effects.
+        if (TheSession->CallStats && Proto->getName() != "__anon__")
+        {
+            TheFunction = EmitCallStatsWrapper(TheFunction, BodyFn);
+            if (!Imported)
+                InferEffects(TheFunction);
+        }
+
+        return TheFunction;
+    }
+
+    // Remove if error in the body. Calls from elsewhere in the module keep
+    // an extern declaration of it.
+    if (BodyFn != TheFunction)
+        BodyFn->eraseFromParent();
+    TheFunction->deleteBody();
+    if (TheFunction->use_empty())
+        TheFunction->eraseFromParent();
+    RestoreDeclaration(Saved);
+    return nullptr;
+}
+
+
+
+// Driver
+
+// With timing on, a marker follows each optimization pass and records the
+// time since the previous marker, which ran just before the pass and the
+// analyses it needed, as that pass's.
+namespace {
+class PassTimingMarker : public llvm::FunctionPass
+{
+    std::string Label;  // empty for the first marker in a pass manager
+
+public:
+    static char ID;
+
+    explicit PassTimingMarker(std::string label)
+        : llvm::FunctionPass(ID), Label(std::move(label)) {}
+
+    virtual bool runOnFunction(llvm::Function &)
+    {
+        uint64_t Now = TheSession->Trace->now();
+        if (!Label.empty())
+            TheSession->Trace->add(stage_pass, Label, TheSession->PassClock, Now);
+        TheSession->PassClock = Now;
+        return false;
+    }
+
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const
+    {
+        AU.setPreservesAll();
+    }
+
+    virtual llvm::StringRef getPassName() const
+    {
+        return "Pass timing marker";
+    }
+};
+} // namespace
+
+char PassTimingMarker::ID = 0;
+
+// Add P to PM, followed by a timing marker if timing is on. Consecutive
+// loop passes share one loop pass manager, which a marker would split, so
+// they are timed together: Pending collects their names.
+template<typename PassManagerT>
+static void AddPass(PassManagerT &PM, llvm::Pass *P, std::string &Pending)
+{
+    if (!TheSession->Trace)
+    {
+        PM.add(P);
+        return;
+    }
+
+    Pending += (Pending.empty() ? "" : " + ") + P->getPassName().str();
+    bool IsLoopPass = P->getPassKind() == llvm::PT_Loop;
+    PM.add(P);
+    if (IsLoopPass)
+        return;
+
+    PM.add(new PassTimingMarker(Pending));
+    Pending.clear();
+}
+
+static llvm::TargetMachine &getTargetMachine()
+{
+    if (TheSession->WorkerTM)
+        return *TheSession->WorkerTM;
+    return TheSession->TheJIT->getTargetMachine();
+}
+
+static void InitializeModuleAndPasses() {
+
+    TheSession->TheModule = std::unique_ptr<llvm::Module>(
+        new llvm::Module("my cool jit", TheSession->TheContext)
+    );
+
+    // Configure JIT
+    TheSession->TheModule->setDataLayout(getTargetMachine().createDataLayout());
+
+    // Create a new builder for the module.
+    TheSession->Builder = std::unique_ptr<llvm::IRBuilder<>>(
+        new llvm::IRBuilder<>(TheSession->TheContext)
+    );
+
+    // FP instructions created by the builder carry these flags.
+    llvm::FastMathFlags FMF;
+    if (TheSession->Opts.FloatMode == kaleidoscope::FPMode::Contract)
+        FMF.setAllowContract();
+    else if (TheSession->Opts.FloatMode == kaleidoscope::FPMode::Fast)
+        FMF.setFast();
+    TheSession->Builder->setFastMathFlags(FMF);
+
+    // Passes
+    TheSession->TheFPM = std::unique_ptr<llvm::legacy::FunctionPassManager>(
+        new llvm::legacy::FunctionPassManager(TheSession->TheModule.get())
+    );
+
+    // Cost model for the vectorizer
+    TheSession->TheFPM->add(llvm::createTargetTransformInfoWrapperPass(
+        getTargetMachine().getTargetIRAnalysis()));
+
+    std::string Pending;
+    auto AddFunctionPass = [&](llvm::Pass *P) {
+        AddPass(*TheSession->TheFPM, P, Pending);
+    };
+    if (TheSession->Trace)
+        TheSession->TheFPM->add(new PassTimingMarker(""));
+
+    AddFunctionPass(llvm::createPromoteMemoryToRegisterPass());
+    AddFunctionPass(llvm::createInstructionCombiningPass());
+    AddFunctionPass(llvm::createReassociatePass());
+    AddFunctionPass(llvm::createGVNPass());
+    AddFunctionPass(llvm::createCFGSimplificationPass());
+
+    // Turn tail self-recursion (and accumulator recursion) into loops,
+    // before the loop passes below see them.
+    if (TheSession->Opts.TailRecursionElim)
+    {
+        AddFunctionPass(llvm::createTailCallEliminationPass());
+        AddFunctionPass(llvm::createCFGSimplificationPass());
+    }
+
+    // Loops: rotate into guarded do-while form, hoist invariants (such as
+    // the bound and array bases) and canonicalize the induction variable
+    // so the vectorizer can work on them.
+    AddFunctionPass(llvm::createLoopRotatePass());
+    AddFunctionPass(llvm::createLICMPass());
+    AddFunctionPass(llvm::createIndVarSimplifyPass());
+    AddFunctionPass(llvm::createLoopVectorizePass());
+    AddFunctionPass(llvm::createInstructionCombiningPass());
+    AddFunctionPass(llvm::createCFGSimplificationPass());
+
+    TheSession->TheFPM->doInitialization();
+
+    // Module passes, only used in -ipo and -pgo-use modes
+    TheSession->TheMPM.reset();
+    if (!TheSession->Opts.IPO && TheSession->Opts.ProfileUse.empty())
+        return;
+
+    TheSession->TheMPM = std::unique_ptr<llvm::legacy::PassManager>(
+        new llvm::legacy::PassManager()
+    );
+
+    auto AddModulePass = [&](llvm::Pass *P) {
+        AddPass(*TheSession->TheMPM, P, Pending);
+    };
+    if (TheSession->Trace)
+        TheSession->TheMPM->add(new PassTimingMarker(""));
+
+    if (TheSession->Opts.IPO)
+    {
+        AddModulePass(llvm::createFunctionInliningPass(TheSession->Opts.IPOInlineThreshold));
+        AddModulePass(llvm::createIPSCCPPass());
+        AddModulePass(llvm::createInstructionCombiningPass());
+        AddModulePass(llvm::createReassociatePass());
+        AddModulePass(llvm::createGVNPass());
+        AddModulePass(llvm::createCFGSimplificationPass());
+        // Imported copies are never emitted, but until they go, GlobalDCE
+        // keeps the private bodies they call (f.impl, f.counted) alive.
+        AddModulePass(llvm::createEliminateAvailableExternallyPass());
+        AddModulePass(llvm::createGlobalDCEPass());
+    }
+
+    if (!TheSession->Opts.ProfileUse.empty())
+        AddModulePass(llvm::createHotColdSplittingPass());
+}
+
+// Copy the bodies of definitions that live in earlier modules into this one
+// as available_externally, so the inliner can see them. The copies are never
+// emitted; calls that are not inlined still bind to the JIT'd original.
+//
+// Each import is codegen'd and optimized again, so only what the inliner
+// can use is imported: callees up to MaxImportDepth calls away, and only
+// bodies small enough to be inlined at the -ipo threshold. Larger ones are
+// measured once per definition and not imported again.
+static const unsigned MaxImportDepth = 3;
+
+static void ImportDefinitions()
+{
+    // Inline cost is counted in InstrCost per instruction; twice the plain
+    // estimate leaves room for what constant arguments simplify away.
+    unsigned MaxSize = 2 * TheSession->Opts.IPOInlineThreshold / llvm::InlineConstants::InstrCost;
+
+    std::set<std::string> Seen;
+    for (unsigned Depth = 0; Depth < MaxImportDepth; ++Depth)
+    {
+        std::vector<llvm::Function*> Decls;
+        for (auto &F : *TheSession->TheModule)
+            if (F.isDeclaration() && TheSession->FunctionDefs.count(F.getName().str()) &&
+                Seen.insert(F.getName().str()).second)
+                Decls.push_back(&F);
+        if (Decls.empty())
+            break;
+
+        for (auto *F : Decls)
+        {
+            std::string Name = F->getName().str();
+            auto &AST = TheSession->FunctionDefs[Name];
+            auto SI = TheSession->ImportSizes.find(Name);
+            if (SI != TheSession->ImportSizes.end() && SI->second.first == AST &&
+                SI->second.second > MaxSize)
+                continue;
+
+            // F, unless codegen() replaced it with a call statistics wrapper.
+            auto *Def = AST->codegen();
+            if (!Def)
+                continue;
+
+            // With its private parts: f.impl, f.counted.
+            unsigned Size = Def->getInstructionCount();
+            std::vector<llvm::Function*> Parts;
+            for (auto &G : *TheSession->TheModule)
+                if (G.hasLocalLinkage() && G.getName().startswith(Name + "."))
+                {
+                    Size += G.getInstructionCount();
+                    Parts.push_back(&G);
+                }
+            TheSession->ImportSizes[Name] = std::make_pair(AST, Size);
+
+            if (Size <= MaxSize)
+            {
+                Def->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+                continue;
+            }
+
+            Def->deleteBody();
+            for (auto *G : Parts)
+                G->deleteBody();
+            for (auto *G : Parts)
+                if (G->use_empty())
+                    G->eraseFromParent();
+        }
+    }
+}
+
+// Whole-module optimization of the current module before it is handed to
+// the JIT. No-op unless -ipo or -pgo-use is given.
+static void OptimizeModule()
+{
+    if (!TheSession->TheMPM)
+        return;
+
+    if (TheSession->Opts.IPO)
+        ImportDefinitions();
+    TheSession->TheMPM->run(*TheSession->TheModule);
+}
+
+// With timing on, count the instructions in TheModule that become code.
+static void CountInstructions()
+{
+    if (!TheSession->Trace)
+        return;
+
+    uint64_t N = 0;
+    for (auto &F : *TheSession->TheModule)
+        if (!F.isDeclarationForLinker())
+            N += F.getInstructionCount();
+    TheSession->Trace->count(counter_ir_insts, N);
+}
+
+// With timing on, count the nodes of a parsed function body.
+static void CountNodes(const FunctionAST &FnAST)
+{
+    if (TheSession->Trace)
+        TheSession->Trace->count(counter_ast_nodes, FnAST.getBody().size());
+}
+
+static void CompileDefinition(std::unique_ptr<FunctionAST> FnAST)
+{
+    if (auto *FnIR = FnAST->codegen()) {
+        ReportItem("function definition", FnIR);
+
+        // Each definition gets its own module, so later modules can
+        // inline it through FunctionDefs.
+        OptimizeModule();
+        CountInstructions();
+        DumpModule(FnAST->getName());
+        {
+            TimeScope Codegen(TheSession->Trace.get(), stage_codegen, FnAST->getName());
+            TheSession->TheJIT->addModule(*TheSession->TheDylib, std::move(TheSession->TheModule));
+        }
+        InitializeModuleAndPasses();
+
+        if (TheSession->Opts.IPO)
+            TheSession->FunctionDefs[FnAST->getName()] = std::move(FnAST);
+    }
+}
+
+static void HandleDefinition() {
+    TimeScope Item(TheSession->Trace.get(), stage_item, "def");
+    TimeScope Parse(TheSession->Trace.get(), stage_parse, "parse");
+    auto FnAST = ParseDefinition();
+    Parse.stop();
+
+    if (FnAST) {
+        Item.setName("def " + FnAST->getName());
+        CountNodes(*FnAST);
+        CompileDefinition(std::move(FnAST));
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
+static void HandleExtern() {
+    TimeScope Item(TheSession->Trace.get(), stage_item, "extern");
+    TimeScope Parse(TheSession->Trace.get(), stage_parse, "parse");
+    auto ProtoAST = ParseExtern();
+    Parse.stop();
+
+    if (ProtoAST) {
+        Item.setName("extern " + ProtoAST->getName());
+        TimeScope IRGen(TheSession->Trace.get(), stage_irgen, ProtoAST->getName());
+        auto *FnIR = ProtoAST->codegen();
+        IRGen.stop();
+
+        if (FnIR) {
+            ReportItem("extern", FnIR);
+            RecognizeMathBuiltin(FnIR);
+            TheSession->FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+        }
+    } else {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static void HandleTopLevelExpression() {
+// Evaluate a top-level expression into an anonymous function.
+    Timeline *Trace = TheSession->Trace.get();
+    TimeScope Item(Trace, stage_item, "expression");
+    TimeScope Parse(Trace, stage_parse, "parse");
+    auto FnAST = ParseTopLevelExpr();
+    Parse.stop();
+
+    if (FnAST) 
+    {
+        CountNodes(*FnAST);
+        if (auto *FnIR = FnAST->codegen()) 
+        {
+            ReportItem("top-level expression", FnIR);
+
+            /*************** JIT ******************/
+            OptimizeModule();
+            CountInstructions();
+            DumpModule("__anon__");
+
+            // Create Handle
+            TimeScope Codegen(Trace, stage_codegen, "__anon__");
+            auto H = TheSession->TheJIT->addModule(*TheSession->TheDylib, std::move(TheSession->TheModule));
+            Codegen.stop();
+            InitializeModuleAndPasses();
+
+            // Search symbol, in the module just added only
+            TimeScope Lookup(Trace, stage_lookup, "__anon__");
+            auto ExprSymbol = TheSession->TheJIT->findSymbolIn(H, "__anon__");
+            assert(ExprSymbol && "Function not found");
+
+            kaleidoscope::Function<double()> Expr(
+                (double (*)())(intptr_t)llvm::cantFail(ExprSymbol.getAddress()));
+            Lookup.stop();
+
+            TimeScope Execute(Trace, stage_execute, "execute");
+            double Value = Expr();
+            Execute.stop();
+            if (TheSession->Results)
+                TheSession->Results->push_back(Value);
+
+            TheSession->TheJIT->removeModule(H);
+
+        }
+    } 
+    else 
+    {
+    // Skip token for error recovery.
+    getNextToken();
+    }
+}
+
+/* Parallel definitions
+ *
+ * With Jobs > 1, a run of consecutive definitions is parsed in full, then
+ * compiled on worker threads: codegen, the function and module passes,
+ * and machine code. The run ends at the next extern or top-level
+ * expression, or at a second definition of a name already in it. Each
+ * worker compiles into a session of its own, with its own context, on a
+ * thread of the process-wide CompilePool using that thread's target
+ * machine, and hands back an object file; the main thread adds
+ * them to the JIT, prints them and records them in source order.
+ *
+ * A definition can only call what was declared before it, so within a
+ * batch it depends only on the earlier definitions it calls, directly or
+ * through functions from before the batch: it needs their inferred effects,
+ * and their bodies under -ipo. It starts once those are done; anything else
+ * starts as soon as a worker is free. Before each definition a worker
+ * brings what it shows of the earlier ones up to date, so each sees the
+ * declarations, effects and bodies it would have seen compiled in order,
+ * and the code is the same either way.
+ */
+// Threads compiling for every session in the process, each with a target
+// machine of its own. The pool grows to the most tasks run at once, the
+// largest Jobs of any Engine, and is shared like the JIT (getSharedPool).
+namespace {
+class CompilePool
+{
+public:
+    using Task = std::function<void(llvm::TargetMachine &)>;
+
+    CompilePool() = default;
+    CompilePool(const CompilePool &) = delete;
+    CompilePool &operator=(const CompilePool &) = delete;
+
+    ~CompilePool()
+    {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Stopping = true;
+        }
+        Changed.notify_all();
+        for (auto &T : Threads)
+            T.join();
+    }
+
+    // Run Tasks and wait for all of them. There are at least as many idle
+    // threads as tasks, so they can all run at once.
+    void run(std::vector<Task> &Tasks)
+    {
+        std::unique_lock<std::mutex> Guard(Lock);
+        while (Idle < Tasks.size())
+        {
+            Threads.emplace_back(&CompilePool::work, this);
+            ++Idle;
+        }
+
+        unsigned Left = Tasks.size();
+        for (auto &T : Tasks)
+            Queue.push_back(std::make_pair(&T, &Left));
+        Idle -= Tasks.size();
+        Changed.notify_all();
+        Changed.wait(Guard, [&]() { return !Left; });
+    }
+
+private:
+    void work()
+    {
+        auto TM = llvm::orc::KaleidoscopeJIT::createTargetMachine();
+
+        std::unique_lock<std::mutex> Guard(Lock);
+        while (true)
+        {
+            Changed.wait(Guard, [&]() { return Stopping || !Queue.empty(); });
+            if (Queue.empty())
+                return;
+
+            auto Next = Queue.front();
+            Queue.pop_front();
+            Guard.unlock();
+            (*Next.first)(*TM);
+            Guard.lock();
+
+            ++Idle;
+            --*Next.second;
+            Changed.notify_all();
+        }
+    }
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::deque<std::pair<Task *, unsigned *>> Queue;  // and the count it is in
+    std::vector<std::thread> Threads;
+    unsigned Idle = 0;      // threads not running or about to run a task
+    bool Stopping = false;
+};
+} // namespace
+
+// What a worker makes of a definition. It is built with the batch lock
+// released and moved into the BatchDef under it, so the other workers only
+// ever see it complete, once Done is set.
+namespace {
+struct BatchResult
+{
+    bool HasEffects = false;
+    FunctionEffects Effects;
+    std::set<std::string> EffectCallees;
+    std::unique_ptr<llvm::MemoryBuffer> Obj;    // null if it failed
+    std::vector<std::unique_ptr<MemoCache>> Caches;
+    std::string Dump;
+    std::vector<std::string> Errors;
+};
+
+struct BatchDef
+{
+    std::shared_ptr<FunctionAST> AST;
+    std::shared_ptr<PrototypeAST> Proto;
+    std::vector<unsigned> Callees;      // earlier definitions it reaches
+    std::vector<unsigned> Dependents;   // later definitions reaching it
+    unsigned Waiting;                   // callees not done yet
+
+    // Under the batch lock
+    bool Done = false;
+    BatchResult Result;
+};
+
+struct DefinitionBatch
+{
+    std::vector<BatchDef> Defs;
+
+    // The main session's state before the batch
+    std::map<std::string, std::shared_ptr<PrototypeAST>> Protos;
+    std::map<std::string, std::shared_ptr<FunctionAST>> Bodies;
+    std::map<std::string, FunctionEffects> Effects;
+    std::map<std::string, std::set<std::string>> EffectCallees;
+    std::map<std::string, std::pair<llvm::Intrinsic::ID, bool>> Builtins;  // f32?
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::deque<unsigned> Ready;
+    unsigned Remaining;
+};
+} // namespace
+
+static void RestoreBuiltin(DefinitionBatch &B, const std::string &Name)
+{
+    auto BI = B.Builtins.find(Name);
+    if (BI == B.Builtins.end())
+    {
+        TheSession->MathBuiltins.erase(Name);
+        return;
+    }
+
+    auto &Ctx = TheSession->TheContext;
+    TheSession->MathBuiltins[Name] = std::make_pair(
+        BI->second.first, BI->second.second ? llvm::Type::getFloatTy(Ctx)
+                                            : llvm::Type::getDoubleTy(Ctx));
+}
+
+// Back to what the main session had before the batch.
+static void ResetBatchView(DefinitionBatch &B)
+{
+    TheSession->FunctionProtos = B.Protos;
+    TheSession->FunctionDefs = B.Bodies;
+    TheSession->InferredEffects = B.Effects;
+    TheSession->EffectCallees = B.EffectCallees;
+    TheSession->MathBuiltins.clear();
+    for (auto &BI : B.Builtins)
+        RestoreBuiltin(B, BI.first);
+    TheSession->BatchVisible = 0;
+}
+
+// Make TheSession, a worker, see definition j as if it had been compiled
+// before, the way CompileBatch records it. One that failed or is not done
+// yet changes nothing. Only a redefinition can have callers whose effects
+// were inferred through an earlier definition. Call with the batch lock
+// held.
+static void ShowBatchDef(DefinitionBatch &B, unsigned j)
+{
+    BatchDef &D = B.Defs[j];
+    TheSession->BatchShownDone[j] = D.Done;
+    if (!D.Done || !D.Result.Obj)
+        return;
+
+    const std::string &Name = D.AST->getName();
+    TheSession->FunctionProtos[Name] = D.Proto;
+    TheSession->MathBuiltins.erase(Name);
+    TheSession->InferredEffects.erase(Name);
+    if (B.Protos.count(Name))
+        InvalidateCallerEffects(Name);
+    TheSession->EffectCallees[Name] = D.Result.EffectCallees;
+    if (D.Result.HasEffects)
+        TheSession->InferredEffects[Name] = D.Result.Effects;
+    if (TheSession->Opts.IPO)
+        TheSession->FunctionDefs[Name] = D.AST;
+}
+
+// The N'th worker of TheSession.
+static kaleidoscope::Session *GetWorker(unsigned N)
+{
+    auto &Workers = TheSession->Workers;
+    while (Workers.size() <= N)
+    {
+        std::unique_ptr<kaleidoscope::Session> W(new kaleidoscope::Session);
+        W->Opts = TheSession->Opts;
+        W->TheJIT = TheSession->TheJIT;
+        W->TheDylib = TheSession->TheDylib;
+        W->LoadedProfile = TheSession->LoadedProfile;
+        W->LoadedShapes = TheSession->LoadedShapes;
+        W->ProfileHotCount = TheSession->ProfileHotCount;
+        W->Trace = TheSession->Trace;
+        W->CallStats = TheSession->CallStats;
+        Workers.push_back(std::move(W));
+    }
+    return Workers[N].get();
+}
+
+static void CompileBatchDef(const BatchDef &D, BatchResult &R)
+{
+    TimeScope Item(TheSession->Trace.get(), stage_item, "def " + D.AST->getName());
+    TheSession->HadError = false;
+    TheSession->Errors.clear();
+
+    llvm::raw_string_ostream OS(R.Dump);
+    TheSession->DumpOS = &OS;
+
+    if (auto *FnIR = D.AST->codegen())
+    {
+        ReportItem("function definition", FnIR);
+
+        OptimizeModule();
+        CountInstructions();
+        DumpModule(D.AST->getName());
+
+        TimeScope Codegen(TheSession->Trace.get(), stage_codegen, D.AST->getName());
+        R.Obj = llvm::orc::SimpleCompiler(*TheSession->WorkerTM)(*TheSession->TheModule);
+    }
+    InitializeModuleAndPasses();
+
+    OS.flush();
+    TheSession->DumpOS = nullptr;
+
+    auto EI = TheSession->InferredEffects.find(D.AST->getName());
+    R.HasEffects = EI != TheSession->InferredEffects.end();
+    if (R.HasEffects)
+        R.Effects = EI->second;
+    R.EffectCallees = TheSession->EffectCallees[D.AST->getName()];
+
+    R.Caches = std::move(TheSession->MemoCaches);
+    TheSession->MemoCaches.clear();
+    R.Errors = std::move(TheSession->Errors);
+    TheSession->Errors.clear();
+}
+
+static void RunBatchWorker(DefinitionBatch &B, kaleidoscope::Session *W, llvm::TargetMachine &TM)
+{
+    SessionScope Scope(W);
+
+    // The pass managers hold on to the target machine.
+    W->WorkerTM = &TM;
+    InitializeModuleAndPasses();
+
+    ResetBatchView(B);
+    W->BatchShownDone.assign(B.Defs.size(), false);
+
+    std::unique_lock<std::mutex> Lock(B.Lock);
+    while (true)
+    {
+        B.Changed.wait(Lock, [&]() { return !B.Ready.empty() || !B.Remaining; });
+        if (B.Ready.empty())
+            return;
+
+        unsigned i = B.Ready.front();
+        B.Ready.pop_front();
+
+        // Show exactly the definitions before i, as they are now. One shown
+        // by an earlier task may have been done since. A new name can just
+        // be shown again, but a redefinition drops the effects of callers
+        // that may have been shown after it, so then start over.
+        bool Stale = W->BatchVisible > i;
+        for (unsigned j = 0; j < W->BatchVisible && !Stale; ++j)
+            Stale = W->BatchShownDone[j] != B.Defs[j].Done &&
+                    B.Protos.count(B.Defs[j].AST->getName());
+        if (Stale)
+            ResetBatchView(B);
+        for (unsigned j = 0; j < W->BatchVisible; ++j)
+            if (W->BatchShownDone[j] != B.Defs[j].Done)
+                ShowBatchDef(B, j);
+        while (W->BatchVisible < i)
+            ShowBatchDef(B, W->BatchVisible++);
+
+        Lock.unlock();
+        BatchResult R;
+        CompileBatchDef(B.Defs[i], R);
+        Lock.lock();
+
+        B.Defs[i].Result = std::move(R);
+        B.Defs[i].Done = true;
+        ShowBatchDef(B, i);
+        W->BatchVisible = i + 1;
+
+        for (unsigned k : B.Defs[i].Dependents)
+            if (--B.Defs[k].Waiting == 0)
+                B.Ready.push_back(k);
+        --B.Remaining;
+        B.Changed.notify_all();
+    }
+}
+
+static void CompileBatch(std::vector<std::unique_ptr<FunctionAST>> Defs)
+{
+    if (Defs.size() < 2)
+    {
+        for (auto &FnAST : Defs)
+            CompileDefinition(std::move(FnAST));
+        return;
+    }
+
+    DefinitionBatch B;
+    B.Defs.resize(Defs.size());
+
+    // Call graph, through the names called in each body. Calls to earlier
+    // definitions follow their bodies and effect callees on to the batch:
+    // redefining a function there changes what the callers' code sees of
+    // it, its effects and, under -ipo, its body.
+    llvm::StringMap<unsigned> Index;
+    for (unsigned i = 0; i != Defs.size(); ++i)
+    {
+        BatchDef &D = B.Defs[i];
+        D.AST = std::move(Defs[i]);
+        D.Proto = std::make_shared<PrototypeAST>(D.AST->getProto());
+
+        std::vector<std::string> Work;
+        std::set<std::string> Seen;
+        auto AddCalls = [&](const ExprPool &P) {
+            for (ExprId E = 0; E != P.size(); ++E)
+                if (P[E].Kind == ek_call && Seen.insert(P.getName(P[E].Name)).second)
+                    Work.push_back(P.getName(P[E].Name));
+        };
+        AddCalls(D.AST->getBody());
+        while (!Work.empty())
+        {
+            std::string Name = std::move(Work.back());
+            Work.pop_back();
+
+            auto I = Index.find(Name);
+            if (I != Index.end())
+            {
+                if (!llvm::is_contained(D.Callees, I->second))
+                    D.Callees.push_back(I->second);
+                continue;
+            }
+
+            auto BI = TheSession->FunctionDefs.find(Name);
+            if (BI != TheSession->FunctionDefs.end())
+                AddCalls(BI->second->getBody());
+            auto EI = TheSession->EffectCallees.find(Name);
+            if (EI != TheSession->EffectCallees.end())
+                for (auto &Callee : EI->second)
+                    if (Seen.insert(Callee).second)
+                        Work.push_back(Callee);
+        }
+
+        for (unsigned j : D.Callees)
+            B.Defs[j].Dependents.push_back(i);
+        D.Waiting = D.Callees.size();
+        if (!D.Waiting)
+            B.Ready.push_back(i);
+
+        Index[D.AST->getName()] = i;
+    }
+    B.Remaining = B.Defs.size();
+
+    B.Protos = TheSession->FunctionProtos;
+    B.Bodies = TheSession->FunctionDefs;
+    B.Effects = TheSession->InferredEffects;
+    B.EffectCallees = TheSession->EffectCallees;
+    for (auto &BI : TheSession->MathBuiltins)
+        B.Builtins[BI.first] = std::make_pair(BI.second.first, BI.second.second->isFloatTy());
+
+    std::vector<CompilePool::Task> Tasks;
+    for (unsigned k = 0; k != std::min<size_t>(TheSession->Opts.Jobs, B.Defs.size()); ++k)
+    {
+        kaleidoscope::Session *W = GetWorker(k);
+        Tasks.push_back([&B, W](llvm::TargetMachine &TM) { RunBatchWorker(B, W, TM); });
+    }
+    TheSession->Pool->run(Tasks);
+
+    // Record the results as HandleDefinition would have, in order.
+    for (auto &D : B.Defs)
+    {
+        const std::string &Name = D.AST->getName();
+        BatchResult &R = D.Result;
+
+        for (auto &C : R.Caches)
+            TheSession->MemoCaches.push_back(std::move(C));
+
+        for (auto &E : R.Errors)
+            LogError(E.c_str());
+
+        // A definition that failed leaves the previous one in effect.
+        llvm::errs() << R.Dump;
+        if (!R.Obj)
+            continue;
+
+        TheSession->FunctionProtos[Name] = D.Proto;
+        TheSession->MathBuiltins.erase(Name);
+        TheSession->InferredEffects.erase(Name);
+        InvalidateCallerEffects(Name);
+        TheSession->EffectCallees[Name] = std::move(R.EffectCallees);
+        if (R.HasEffects)
+            TheSession->InferredEffects[Name] = R.Effects;
+
+        TheSession->TheJIT->addObject(*TheSession->TheDylib, std::move(R.Obj));
+        if (TheSession->Opts.IPO)
+            TheSession->FunctionDefs[Name] = D.AST;
+    }
+}
+
+// Parse definitions up to the end of the run and compile them as batches.
+static void HandleDefinitions()
+{
+    std::vector<std::unique_ptr<FunctionAST>> Batch;
+    std::set<std::string> Names;
+
+    while (true)
+    {
+        if (TheSession->Curtok == ';')
+        {
+            getNextToken();
+            continue;
+        }
+        if (TheSession->Curtok != tok_def && TheSession->Curtok != tok_memo)
+            break;
+
+        TimeScope Parse(TheSession->Trace.get(), stage_parse, "parse");
+        auto FnAST = ParseDefinition();
+        Parse.stop();
+        if (!FnAST)
+        {
+            getNextToken();     // skip token for error recovery
+            continue;
+        }
+        CountNodes(*FnAST);
+
+        if (!Names.insert(FnAST->getName()).second)
+        {
+            CompileBatch(std::move(Batch));
+            Batch.clear();
+            Names = {FnAST->getName()};
+        }
+        Batch.push_back(std::move(FnAST));
+    }
+
+    CompileBatch(std::move(Batch));
+}
+
+static void MainLoop()
+{
+    while (true)
+    {
+        switch (TheSession->Curtok)
+        {
+        case tok_eof:
+            return;
+        case ';':
+            getNextToken();
+            break;
+        case tok_def:
+        case tok_memo:
+            if (TheSession->Opts.Jobs > 1 && TheSession->Opts.ProfileGen.empty())
+                HandleDefinitions();
+            else
+                HandleDefinition();
+            break;
+        case tok_extern:
+            HandleExtern();
+            break;
+        default:
+            HandleTopLevelExpression();
+            break;
+        }
+    }
+}
+
+
+// "Library" functions that can be "extern'd" from user code.
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// newf64 - Zeroed buffer of N doubles: "extern newf64(n:i64):f64[]".
+extern "C" DLLEXPORT double *newf64(int64_t N)
+{
+    return (double *)calloc(N, sizeof(double));
+}
+
+// Host functions externs bind to without a dynamic-linker lookup: the
+// library functions above, libm (also what math intrinsics lower to when
+// the target has no instruction for them) and clock for timing.
+static void RegisterHostSymbols()
+{
+    using F64x1 = double (*)(double);
+    using F64x2 = double (*)(double, double);
+    using F64x3 = double (*)(double, double, double);
+    using F32x1 = float (*)(float);
+    using F32x2 = float (*)(float, float);
+    using F32x3 = float (*)(float, float, float);
+
+    const std::pair<const char *, void *> Symbols[] = {
+        {"newf64", (void *)&newf64},
+        {"clock", (void *)&clock},
+
+        {"sin", (void *)(F64x1)&::sin},       {"sinf", (void *)(F32x1)&::sinf},
+        {"cos", (void *)(F64x1)&::cos},       {"cosf", (void *)(F32x1)&::cosf},
+        {"sqrt", (void *)(F64x1)&::sqrt},     {"sqrtf", (void *)(F32x1)&::sqrtf},
+        {"exp", (void *)(F64x1)&::exp},       {"expf", (void *)(F32x1)&::expf},
+        {"exp2", (void *)(F64x1)&::exp2},     {"exp2f", (void *)(F32x1)&::exp2f},
+        {"log", (void *)(F64x1)&::log},       {"logf", (void *)(F32x1)&::logf},
+        {"log2", (void *)(F64x1)&::log2},     {"log2f", (void *)(F32x1)&::log2f},
+        {"log10", (void *)(F64x1)&::log10},   {"log10f", (void *)(F32x1)&::log10f},
+        {"fabs", (void *)(F64x1)&::fabs},     {"fabsf", (void *)(F32x1)&::fabsf},
+        {"floor", (void *)(F64x1)&::floor},   {"floorf", (void *)(F32x1)&::floorf},
+        {"ceil", (void *)(F64x1)&::ceil},     {"ceilf", (void *)(F32x1)&::ceilf},
+        {"trunc", (void *)(F64x1)&::trunc},   {"truncf", (void *)(F32x1)&::truncf},
+        {"round", (void *)(F64x1)&::round},   {"roundf", (void *)(F32x1)&::roundf},
+        {"pow", (void *)(F64x2)&::pow},       {"powf", (void *)(F32x2)&::powf},
+        {"fmin", (void *)(F64x2)&::fmin},     {"fminf", (void *)(F32x2)&::fminf},
+        {"fmax", (void *)(F64x2)&::fmax},     {"fmaxf", (void *)(F32x2)&::fmaxf},
+        {"copysign", (void *)(F64x2)&::copysign}, {"copysignf", (void *)(F32x2)&::copysignf},
+        {"fma", (void *)(F64x3)&::fma},       {"fmaf", (void *)(F32x3)&::fmaf},
+        {"tan", (void *)(F64x1)&::tan},       {"atan2", (void *)(F64x2)&::atan2},
+    };
+
+    for (auto &S : Symbols)
+        TheSession->TheJIT->addHostSymbol(*TheSession->TheDylib, S.first, S.second);
+
+    TheSession->TheJIT->setProcessSymbolFallback(*TheSession->TheDylib, TheSession->Opts.ProcessSymbols);
+}
+
+
+/* Engine */
+namespace kaleidoscope {
+
+// The JIT shared by all sessions: created with the first and destroyed with
+// the last, so target initialization and JIT startup happen once.
+static std::shared_ptr<llvm::orc::KaleidoscopeJIT> getSharedJIT()
+{
+    static std::weak_ptr<llvm::orc::KaleidoscopeJIT> Shared;
+
+    auto JIT = Shared.lock();
+    if (!JIT)
+    {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmParser();
+        llvm::InitializeNativeTargetAsmPrinter();
+
+        JIT = std::make_shared<llvm::orc::KaleidoscopeJIT>();
+        Shared = JIT;
+    }
+    return JIT;
+}
+
+// The compile threads shared by all sessions that use them, kept like the
+// JIT.
+static std::shared_ptr<CompilePool> getSharedPool()
+{
+    static std::weak_ptr<CompilePool> Shared;
+
+    auto Pool = Shared.lock();
+    if (!Pool)
+    {
+        Pool = std::make_shared<CompilePool>();
+        Shared = Pool;
+    }
+    return Pool;
+}
+
+// Names the functions of each linked object in /tmp/perf-<pid>.map, one
+// "start size name" line each, in hex, which perf reads to attribute
+// samples in JIT'd code. Entries are never taken out: a removed function's
+// range can be reused, and perf prefers the later entry.
+class PerfMapListener : public llvm::JITEventListener
+{
+    FILE *Out;
+
+public:
+    PerfMapListener()
+    {
+        std::string Path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        Out = fopen(Path.c_str(), "w");
+        if (!Out)
+            fprintf(stderr, "Cannot write perf map %s: %s\n", Path.c_str(), strerror(errno));
+    }
+
+    virtual void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile &Obj,
+                                    const llvm::RuntimeDyld::LoadedObjectInfo &Info)
+    {
+        // The debug copy has its sections at their load addresses.
+        auto DebugObj = Info.getObjectForDebug(Obj);
+        if (!Out || !DebugObj.getBinary())
+            return;
+
+        for (auto &P : llvm::object::computeSymbolSizes(*DebugObj.getBinary()))
+        {
+            auto Type = P.first.getType();
+            auto Name = P.first.getName();
+            auto Addr = P.first.getAddress();
+            if (!Type || !Name || !Addr || *Type != llvm::object::SymbolRef::ST_Function)
+            {
+                llvm::consumeError(Type.takeError());
+                llvm::consumeError(Name.takeError());
+                llvm::consumeError(Addr.takeError());
+                continue;
+            }
+            fprintf(Out, "%llx %llx %s\n", (unsigned long long)*Addr,
+                    (unsigned long long)P.second, Name->str().c_str());
+        }
+        fflush(Out);
+    }
+};
+
+// Register the profiler and debugger listeners asked for with the shared
+// JIT. They are process-wide singletons, so other engines see them too.
+static void RegisterEventListeners()
+{
+    auto &JIT = *TheSession->TheJIT;
+
+    if (TheSession->Opts.DebuggerRegistration)
+        JIT.addEventListener(*llvm::JITEventListener::createGDBRegistrationListener());
+
+    if (TheSession->Opts.PerfMap)
+    {
+        static PerfMapListener PerfMap;
+        JIT.addEventListener(PerfMap);
+    }
+
+    if (TheSession->Opts.PerfJITDump)
+    {
+        if (auto *L = llvm::JITEventListener::createPerfJITEventListener())
+            JIT.addEventListener(*L);
+        else
+            fprintf(stderr, "This LLVM was built without perf jitdump support\n");
+    }
+}
+
+Engine::Engine(const EngineOptions &Options) : State(new Session)
+{
+    SessionScope Scope(State.get());
+    State->Opts = Options;
+
+    State->TheJIT = getSharedJIT();
+    State->TheDylib = &State->TheJIT->createDylib();
+    if (State->Opts.Jobs > 1 && State->Opts.ProfileGen.empty())
+        State->Pool = getSharedPool();
+    RegisterHostSymbols();
+    RegisterEventListeners();
+
+    if (State->Opts.Timing || !State->Opts.TraceFile.empty())
+    {
+        State->Trace = std::make_shared<Timeline>();
+
+        // Objects are linked, and their code counted, on first lookup.
+        Timeline *Trace = State->Trace.get();
+        State->TheDylib->NotifyLoaded = [Trace](const llvm::object::ObjectFile &Obj) {
+            uint64_t Bytes = 0;
+            for (const auto &Section : Obj.sections())
+                if (Section.isText())
+                    Bytes += Section.getSize();
+            Trace->count(counter_code_bytes, Bytes);
+        };
+    }
+
+    if (State->Opts.CallStats)
+        State->CallStats = std::make_shared<CallStatsTable>();
+
+    if (!State->Opts.ProfileUse.empty())
+        ReadProfile();
+
+    InitializeModuleAndPasses();
+}
+
+Engine::~Engine()
+{
+    SessionScope Scope(State.get());
+
+    if (!State->Opts.ProfileGen.empty())
+        WriteProfile();
+
+    std::string Error;
+    if (!State->Opts.TraceFile.empty() && !State->Trace->writeChromeTrace(State->Opts.TraceFile, Error))
+        fprintf(stderr, "%s\n", Error.c_str());
+
+    // Free the code before the counters and caches it points to.
+    State->TheJIT->removeDylib(*State->TheDylib);
+}
+
+bool Engine::compile(llvm::StringRef Source, std::vector<double> *Values)
+{
+    SessionScope Scope(State.get());
+
+    {
+        TimeScope Lex(State->Trace.get(), stage_lex, "lex");
+        LexSource(Source);
+    }
+    State->HadError = false;
+    State->Errors.clear();
+    State->Results = Values;
+
+    getNextToken();
+    MainLoop();
+
+    State->Results = nullptr;
+    return !State->HadError;
+}
+
+void *Engine::getAddress(llvm::StringRef Name, llvm::StringRef Signature)
+{
+    auto PI = State->FunctionProtos.find(Name.str());
+    if (PI == State->FunctionProtos.end())
+    {
+        State->LastError = "Unknown function " + Name.str();
+        return nullptr;
+    }
+
+    if (PI->second->getSignature() != Signature)
+    {
+        State->LastError = Name.str() + " is " + PI->second->getSignature() +
+                           ", not " + Signature.str();
+        return nullptr;
+    }
+
+    TimeScope Lookup(State->Trace.get(), stage_lookup, Name);
+    auto Sym = State->TheJIT->findSymbol(*State->TheDylib, Name.str());
+    if (!Sym)
+    {
+        State->LastError = "No code for " + Name.str();
+        return nullptr;
+    }
+
+    return (void *)(intptr_t)llvm::cantFail(Sym.getAddress());
+}
+
+void Engine::addHostSymbol(llvm::StringRef Name, void *Addr)
+{
+    State->TheJIT->addHostSymbol(*State->TheDylib, Name.str(), Addr);
+}
+
+const std::string &Engine::getLastError() const
+{
+    return State->LastError;
+}
+
+const std::vector<std::string> &Engine::getErrors() const
+{
+    return State->Errors;
+}
+
+void Engine::printMemoStats() const
+{
+    SessionScope Scope(State.get());
+    PrintMemoStats();
+}
+
+std::vector<FunctionStats> Engine::getCallStats() const
+{
+    std::vector<FunctionStats> Stats;
+    if (!State->CallStats)
+        return Stats;
+
+    std::lock_guard<std::mutex> Guard(State->CallStats->Lock);
+    for (auto &F : State->CallStats->Functions)
+        Stats.push_back({F.first, F.second.Calls, F.second.Cycles});
+    std::stable_sort(Stats.begin(), Stats.end(), [](const FunctionStats &A, const FunctionStats &B) {
+        return A.Cycles > B.Cycles;
+    });
+    return Stats;
+}
+
+void Engine::resetCallStats()
+{
+    if (!State->CallStats)
+        return;
+
+    std::lock_guard<std::mutex> Guard(State->CallStats->Lock);
+    for (auto &F : State->CallStats->Functions)
+        F.second.Calls = F.second.Cycles = 0;
+}
+
+void Engine::printCallStats() const
+{
+    auto Stats = getCallStats();
+    if (Stats.empty())
+        return;
+
+    uint64_t Total = 0;
+    for (auto &F : Stats)
+        Total += F.Cycles;
+    double Scale = Total ? 100.0 / Total : 0;
+
+    fprintf(stderr, "%-24s %12s %16s %12s %6s\n", "function", "calls", "cycles", "cycles/call", "%");
+    for (auto &F : Stats)
+        fprintf(stderr, "%-24s %12llu %16llu %12.0f %6.1f\n", F.Name.c_str(),
+                (unsigned long long)F.Calls, (unsigned long long)F.Cycles,
+                F.Calls ? (double)F.Cycles / F.Calls : 0.0, F.Cycles * Scale);
+}
+
+void Engine::printTimingReport() const
+{
+    if (State->Trace)
+        State->Trace->report(stderr);
+}
+
+} // namespace kaleidoscope
@@ -0,0 +1,225 @@
+#ifndef KALEIDOSCOPE_ENGINE_H
+#define KALEIDOSCOPE_ENGINE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/StringRef.h>
+
+
+namespace kaleidoscope {
+
+// Floating-point semantics for arithmetic on f32/f64 values.
+enum class FPMode
+{
+    Strict,     // IEEE semantics, no reassociation or contraction
+    Contract,   // allow fusing a*b+c into FMA
+    Fast        // all fast-math flags (reassociation, no NaN/Inf, ...)
+};
+
+struct EngineOptions
+{
+    FPMode FloatMode = FPMode::Strict;
+
+    // Inline and propagate constants across definitions, including ones
+    // JIT'd by earlier compile() calls.
+    bool IPO = false;
+    unsigned IPOInlineThreshold = 225;
+
+    // Turn tail recursion into loops.
+    bool TailRecursionElim = true;
+
+    // Instrument definitions and write their counters to this file when the
+    // engine is destroyed / optimize using the counters in this file.
+    std::string ProfileGen;
+    std::string ProfileUse;
+
+    // Cache entries per memo function (rounded up to a power of two).
+    unsigned MemoEntries = 4096;
+
+    // Let externs that are not registered host symbols bind to anything
+    // the process exports.
+    bool ProcessSymbols = true;
+
+    // Threads compiling runs of consecutive definitions in parallel; 1
+    // compiles everything in order on the calling thread. Ignored with
+    // ProfileGen, whose counters all definitions share.
+    unsigned Jobs = 1;
+
+    // Time each stage of compiling and running every top-level item, and
+    // each optimization pass, for printTimingReport(). With TraceFile set,
+    // all of it is also written there as a Chrome trace when the engine is
+    // destroyed.
+    bool Timing = false;
+    std::string TraceFile;
+
+    // Make JIT'd functions visible to external tools, for all engines in
+    // the process from this one on: register objects with GDB's JIT
+    // interface, name functions in /tmp/perf-<pid>.map for perf, and write
+    // a jitdump file for "perf inject --jit" (only if LLVM was built with
+    // perf support).
+    bool DebuggerRegistration = false;
+    bool PerfMap = false;
+    bool PerfJITDump = false;
+
+    // Count the calls to every definition and the cycles spent in them
+    // (read from the CPU's cycle counter), for getCallStats().
+    bool CallStats = false;
+
+    // What is printed to stderr while compiling; nothing by default.
+    // Verbosity 1 names each definition, extern and expression, 2 also
+    // prints its IR after the function passes. DumpIRBefore prints a
+    // definition's IR before its passes, DumpIRAfter its module as it goes
+    // to the JIT (after the module passes too) and DumpAsm the assembly
+    // made of that; only for the definitions named in DumpFunctions
+    // ("__anon__" for expressions), or all of them if it is empty.
+    unsigned Verbosity = 0;
+    bool DumpIRBefore = false;
+    bool DumpIRAfter = false;
+    bool DumpAsm = false;
+    std::vector<std::string> DumpFunctions;
+};
+
+
+// Calls to a definition from outside itself and the cycles spent in them,
+// recursion included (EngineOptions::CallStats).
+struct FunctionStats
+{
+    std::string Name;
+    uint64_t Calls;
+    uint64_t Cycles;
+};
+
+
+// Kaleidoscope type name of a host type, for checking lookup<>() signatures.
+template<typename T> struct KType;
+template<> struct KType<bool> { static std::string name() { return "bool"; } };
+template<> struct KType<int32_t> { static std::string name() { return "i32"; } };
+template<> struct KType<int64_t> { static std::string name() { return "i64"; } };
+template<> struct KType<float> { static std::string name() { return "f32"; } };
+template<> struct KType<double> { static std::string name() { return "f64"; } };
+template<typename T> struct KType<T *>
+{
+    static std::string name() { return KType<T>::name() + "[]"; }
+};
+
+template<typename Sig> struct KSignature;
+template<typename R, typename... Args> struct KSignature<R(Args...)>
+{
+    // "f64(i64,f64[])"
+    static std::string name()
+    {
+        std::string Params;
+        for (const std::string &P : {std::string(), KType<Args>::name()...})
+            if (!P.empty())
+                Params += (Params.empty() ? "" : ",") + P;
+        return KType<R>::name() + "(" + Params + ")";
+    }
+};
+
+
+// Typed handle to a JIT'd function, resolved once by Engine::get(). A call
+// is a single indirect call: no symbol lookup, no signature check. The
+// handle keeps calling the code it was resolved to, even if the function is
+// later redefined.
+template<typename Sig> class Function;
+template<typename R, typename... Args> class Function<R(Args...)>
+{
+    R (*Ptr)(Args...) = nullptr;
+
+public:
+    Function() = default;
+    explicit Function(R (*P)(Args...)) : Ptr(P) {}
+
+    R operator()(Args... A) const
+    {
+        return Ptr(A...);
+    }
+
+    explicit operator bool() const
+    {
+        return Ptr != nullptr;
+    }
+
+    R (*getPointer() const)(Args...)
+    {
+        return Ptr;
+    }
+};
+
+
+/* Engine
+ *
+ * The JIT behind the REPL, usable from any host program: compile() parses
+ * and JITs a chunk of Kaleidoscope source (definitions, externs and
+ * top-level expressions, in any number), and lookup() returns a callable
+ * pointer to a definition once its signature has been checked against the
+ * host type it is called through.
+ *
+ * Every Engine is an isolated session with its own definitions, operator
+ * table and symbol namespace; externs only bind to its own host symbols
+ * (and the process). All Engines in a process share one JIT and target
+ * machine, which are not thread-safe: use them from one thread at a time.
+ */
+struct Session;
+
+class Engine
+{
+public:
+    explicit Engine(const EngineOptions &Options = EngineOptions());
+    ~Engine();
+
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+
+    // Compile and run Source. The values of its top-level expressions are
+    // appended to Results, if given. Returns false if anything in Source
+    // failed to parse or compile; the rest of Source is still processed and
+    // getLastError() describes the last failure.
+    bool compile(llvm::StringRef Source, std::vector<double> *Results = nullptr);
+
+    // Address of the function Name (a definition or extern), or nullptr if
+    // it does not exist or its signature is not Sig, e.g.
+    // lookup<double(int64_t, double *)>("f") for "def f(n:i64 x:f64[])".
+    template<typename Sig>
+    Sig *lookup(llvm::StringRef Name)
+    {
+        return reinterpret_cast<Sig *>(getAddress(Name, KSignature<Sig>::name()));
+    }
+
+    // lookup() wrapped in a Function handle; empty if lookup() fails.
+    template<typename Sig>
+    Function<Sig> get(llvm::StringRef Name)
+    {
+        return Function<Sig>(lookup<Sig>(Name));
+    }
+
+    // Untyped form of lookup(). Signature is written like "f64(i64,f64[])".
+    void *getAddress(llvm::StringRef Name, llvm::StringRef Signature);
+
+    // Make Addr visible to "extern Name(...)" in later compile() calls.
+    void addHostSymbol(llvm::StringRef Name, void *Addr);
+
+    // The last failure of compile() or lookup(), and every failure of the
+    // last compile() in order. Nothing is printed; that is up to the host.
+    const std::string &getLastError() const;
+    const std::vector<std::string> &getErrors() const;
+
+    // Call statistics by definition, most cycles first; empty unless
+    // EngineOptions::CallStats. resetCallStats() zeroes them.
+    std::vector<FunctionStats> getCallStats() const;
+    void resetCallStats();
+
+    void printMemoStats() const;
+    void printCallStats() const;
+    void printTimingReport() const;
+
+private:
+    std::unique_ptr<Session> State;
+};
+
+} // namespace kaleidoscope
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef KALEIDOSCOPE_NUMBER_H
+#define KALEIDOSCOPE_NUMBER_H
+
+#include <cmath>
+#include <cstdint>
+
+#include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/StringRef.h>
+
+
+namespace kaleidoscope {
+
+/* Number literals
+ *
+ * parseNumber() converts a literal of the form [0-9]*.?[0-9]* with at least
+ * one digit, the only form the lexer produces, to the nearest double. It
+ * does not depend on the locale and does not allocate.
+ *
+ * The first 19 significant digits are gathered into an integer V, and the
+ * literal is V * 10^E (plus whatever digits were dropped). Then, fastest
+ * first:
+ *
+ *  - V <= 2^53 and |E| <= 22: V and 10^|E| are exact doubles, so a single
+ *    IEEE multiply or divide is correctly rounded (Clinger's fast path).
+ *  - |E| <= 19: V * 10^E is formed exactly, or V / 10^-E to 63+ bits with a
+ *    sticky remainder, in 128-bit integers, and rounded to nearest-even by
+ *    hand. If digits were dropped, the same is done for V + 1, and the
+ *    result stands if both round to the same double.
+ *  - Otherwise APFloat's decimal conversion, which is exact but slow.
+ *
+ * Returns false, leaving Result alone, if the literal is malformed: no
+ * digits, or more than one '.'.
+ */
+namespace number_detail {
+
+static const uint64_t Pow10U64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static const double Pow10F64[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline int bitLength(unsigned __int128 X)
+{
+    uint64_t Hi = (uint64_t)(X >> 64);
+    return Hi ? 128 - __builtin_clzll(Hi) : 64 - __builtin_clzll((uint64_t)X);
+}
+
+// Nearest double to (Q + s) * 2^Exp2, where 0 < s < 1 if Sticky and s = 0
+// otherwise. Q must have more than 53 bits if Sticky.
+inline double roundToDouble(unsigned __int128 Q, bool Sticky, int Exp2)
+{
+    int Shift = bitLength(Q) - 53;
+    if (Shift <= 0)
+        return std::ldexp((double)(uint64_t)Q, Exp2);
+
+    uint64_t Mant = (uint64_t)(Q >> Shift);
+    unsigned __int128 Rest = Q & (((unsigned __int128)1 << Shift) - 1);
+    unsigned __int128 Half = (unsigned __int128)1 << (Shift - 1);
+    if (Rest > Half || (Rest == Half && (Sticky || (Mant & 1))))
+        ++Mant;     // may carry to 2^53, which is still exact
+
+    return std::ldexp((double)Mant, Exp2 + Shift);
+}
+
+// Nearest double to V * 10^E, for V > 0 and |E| <= 19.
+inline double exactScale(uint64_t V, int E)
+{
+    if (E >= 0)
+        return roundToDouble((unsigned __int128)V * Pow10U64[E], false, 0);
+
+    // Scale V up to 127 bits so the quotient keeps at least 63 of them.
+    int S = 127 - (64 - __builtin_clzll(V));
+    unsigned __int128 N = (unsigned __int128)V << S;
+    uint64_t D = Pow10U64[-E];
+    return roundToDouble(N / D, N % D != 0, -S);
+}
+
+} // namespace number_detail
+
+inline bool parseNumber(const char *Begin, const char *End, double &Result)
+{
+    using namespace number_detail;
+
+    uint64_t V = 0;
+    int Digits = 0;     // significant digits in V
+    int E = 0;
+    bool Dot = false, AnyDigit = false, Dropped = false;
+
+    for (const char *P = Begin; P != End; ++P)
+    {
+        if (*P == '.')
+        {
+            if (Dot)
+                return false;
+            Dot = true;
+            continue;
+        }
+
+        AnyDigit = true;
+        if (Digits < 19)
+        {
+            V = V * 10 + (*P - '0');
+            if (V)
+                ++Digits;
+            if (Dot)
+                --E;
+        }
+        else
+        {
+            Dropped |= *P != '0';
+            if (!Dot)
+                ++E;
+        }
+    }
+
+    if (!AnyDigit)
+        return false;
+
+    if (V == 0)
+    {
+        Result = 0;
+        return true;
+    }
+
+    if (!Dropped && V <= (uint64_t(1) << 53) && E >= -22 && E <= 22)
+    {
+        Result = E < 0 ? (double)V / Pow10F64[-E] : (double)V * Pow10F64[E];
+        return true;
+    }
+
+    if (E >= -19 && E <= 19)
+    {
+        double D = exactScale(V, E);
+        if (!Dropped || exactScale(V + 1, E) == D)
+        {
+            Result = D;
+            return true;
+        }
+    }
+
+    llvm::APFloat F(llvm::APFloat::IEEEdouble(), llvm::StringRef(Begin, End - Begin));
+    Result = F.convertToDouble();
+    return true;
+}
+
+} // namespace kaleidoscope
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef KALEIDOSCOPE_SCAN_H
+#define KALEIDOSCOPE_SCAN_H
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define KALEIDOSCOPE_SCAN_X86 1
+#endif
+
+
+namespace kaleidoscope {
+
+/* Character-class scanning for the lexer
+ *
+ * skip<Class>(P, End) returns the first character in [P, End) that is not
+ * in Class, or End. On x86, runs longer than a few characters (indentation,
+ * comments, long names) are scanned 16 characters per step with SSE2;
+ * elsewhere it is the scalar loop. The classes match the C locale's
+ * isspace/isalnum, which the lexer used before.
+ *
+ * bench/lexbench.cpp measures each variant, including AVX2 ones. Runs in
+ * source code are short enough that 32-byte steps lose to 16-byte ones, so
+ * skip() does not use AVX2 (and needs no CPU check).
+ */
+enum CharClass
+{
+    cc_space,           // ' ' \t \n \v \f \r
+    cc_alnum,           // [0-9A-Za-z], identifier characters
+    cc_number,          // [0-9.], number characters
+    cc_not_line_end     // anything but \n and \r, comment text
+};
+
+template<CharClass CC> inline bool inClass(unsigned char C)
+{
+    switch (CC)
+    {
+    case cc_space:
+        return C == ' ' || (C >= '\t' && C <= '\r');
+    case cc_alnum:
+        return (C >= '0' && C <= '9') || ((C | 0x20) >= 'a' && (C | 0x20) <= 'z');
+    case cc_number:
+        return (C >= '0' && C <= '9') || C == '.';
+    case cc_not_line_end:
+        return C != '\n' && C != '\r';
+    }
+    return false;
+}
+
+template<CharClass CC> inline const char *skipScalar(const char *P, const char *End)
+{
+    while (P != End && inClass<CC>(*P))
+        ++P;
+    return P;
+}
+
+
+#ifdef KALEIDOSCOPE_SCAN_X86
+
+// Bytes are compared as signed, so anything >= 0x80 is below every range
+// and in no class but cc_not_line_end. Matching lanes are set to 0xFF.
+inline __m128i inRange16(__m128i C, char Lo, char Hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(C, _mm_set1_epi8(Lo - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(Hi + 1), C));
+}
+
+inline __m128i is16(__m128i C, char X)
+{
+    return _mm_cmpeq_epi8(C, _mm_set1_epi8(X));
+}
+
+template<CharClass CC> inline __m128i match16(__m128i C)
+{
+    switch (CC)
+    {
+    case cc_space:
+        return _mm_or_si128(is16(C, ' '), inRange16(C, '\t', '\r'));
+    case cc_alnum:
+        return _mm_or_si128(inRange16(C, '0', '9'),
+                            inRange16(_mm_or_si128(C, _mm_set1_epi8(0x20)), 'a', 'z'));
+    case cc_number:
+        return _mm_or_si128(inRange16(C, '0', '9'), is16(C, '.'));
+    case cc_not_line_end:
+        return _mm_andnot_si128(_mm_or_si128(is16(C, '\n'), is16(C, '\r')), _mm_set1_epi8(-1));
+    }
+    return _mm_setzero_si128();
+}
+
+template<CharClass CC> inline const char *skipSSE2(const char *P, const char *End)
+{
+    while (End - P >= 16)
+    {
+        __m128i C = _mm_loadu_si128((const __m128i *)P);
+        unsigned Miss = ~(unsigned)_mm_movemask_epi8(match16<CC>(C)) & 0xFFFF;
+        if (Miss)
+            return P + __builtin_ctz(Miss);
+        P += 16;
+    }
+    return skipScalar<CC>(P, End);
+}
+
+__attribute__((target("avx2"))) inline __m256i inRange32(__m256i C, char Lo, char Hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(C, _mm256_set1_epi8(Lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(Hi + 1), C));
+}
+
+__attribute__((target("avx2"))) inline __m256i is32(__m256i C, char X)
+{
+    return _mm256_cmpeq_epi8(C, _mm256_set1_epi8(X));
+}
+
+template<CharClass CC> __attribute__((target("avx2"))) inline __m256i match32(__m256i C)
+{
+    switch (CC)
+    {
+    case cc_space:
+        return _mm256_or_si256(is32(C, ' '), inRange32(C, '\t', '\r'));
+    case cc_alnum:
+        return _mm256_or_si256(inRange32(C, '0', '9'),
+                               inRange32(_mm256_or_si256(C, _mm256_set1_epi8(0x20)), 'a', 'z'));
+    case cc_number:
+        return _mm256_or_si256(inRange32(C, '0', '9'), is32(C, '.'));
+    case cc_not_line_end:
+        return _mm256_andnot_si256(_mm256_or_si256(is32(C, '\n'), is32(C, '\r')),
+                                   _mm256_set1_epi8(-1));
+    }
+    return _mm256_setzero_si256();
+}
+
+template<CharClass CC> __attribute__((target("avx2")))
+inline const char *skipAVX2(const char *P, const char *End)
+{
+    while (End - P >= 32)
+    {
+        __m256i C = _mm256_loadu_si256((const __m256i *)P);
+        unsigned Miss = ~(unsigned)_mm256_movemask_epi8(match32<CC>(C));
+        if (Miss)
+            return P + __builtin_ctz(Miss);
+        P += 32;
+    }
+    return skipSSE2<CC>(P, End);
+}
+
+#endif // KALEIDOSCOPE_SCAN_X86
+
+
+// Most runs (a space, a short name) end within a few characters, where
+// setting up a vector compare costs more than it saves: the first 8
+// characters are tested one at a time, and only a longer run goes on to
+// Vector.
+template<CharClass CC, const char *(*Vector)(const char *, const char *)>
+inline const char *skipHybrid(const char *P, const char *End)
+{
+    for (const char *Short = End - P > 8 ? P + 8 : End; P != Short; ++P)
+        if (!inClass<CC>(*P))
+            return P;
+    if (P == End)
+        return P;
+    return Vector(P, End);
+}
+
+template<CharClass CC> inline const char *skip(const char *P, const char *End)
+{
+#ifdef KALEIDOSCOPE_SCAN_X86
+    return skipHybrid<CC, skipSSE2<CC>>(P, End);
+#else
+    return skipScalar<CC>(P, End);
+#endif
+}
+
+} // namespace kaleidoscope
+
+#endif
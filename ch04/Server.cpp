@@ -0,0 +1,263 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace kaleidoscope {
+
+static void AppendU32(std::string &Out, uint32_t V)
+{
+    Out.append((const char *)&V, sizeof(V));
+}
+
+static uint32_t ReadU32(const char *P)
+{
+    uint32_t V;
+    memcpy(&V, P, sizeof(V));
+    return V;
+}
+
+// True if In starts with a complete request frame, or with a header no
+// request can have, which process() rejects.
+static bool HasRequest(const std::string &In)
+{
+    if (In.size() < 8)
+        return false;
+    uint32_t Len = ReadU32(&In[4]);
+    return Len > Server::MaxSourceLen || In.size() - 8 >= Len;
+}
+
+static bool SetNonBlocking(int Fd)
+{
+    int Flags = fcntl(Fd, F_GETFL, 0);
+    return Flags >= 0 && fcntl(Fd, F_SETFL, Flags | O_NONBLOCK) == 0;
+}
+
+
+Server::~Server()
+{
+    for (auto &C : Connections)
+        ::close(C.first);
+
+    if (ListenFd >= 0)
+    {
+        ::close(ListenFd);
+        unlink(Path.c_str());
+    }
+}
+
+bool Server::listen(const std::string &SocketPath)
+{
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Addr.sun_path))
+    {
+        LastError = "Socket path too long: " + SocketPath;
+        return false;
+    }
+    strcpy(Addr.sun_path, SocketPath.c_str());
+
+    ListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ListenFd < 0)
+    {
+        LastError = std::string("socket: ") + strerror(errno);
+        return false;
+    }
+
+    unlink(SocketPath.c_str());
+    if (bind(ListenFd, (sockaddr *)&Addr, sizeof(Addr)) != 0 ||
+        ::listen(ListenFd, SOMAXCONN) != 0 || !SetNonBlocking(ListenFd))
+    {
+        LastError = SocketPath + ": " + strerror(errno);
+        ::close(ListenFd);
+        ListenFd = -1;
+        return false;
+    }
+
+    Path = SocketPath;
+    return true;
+}
+
+void Server::run()
+{
+    std::vector<pollfd> Fds;
+
+    while (ListenFd >= 0)
+    {
+        // Read only from connections with no request waiting and room for
+        // the answers. Waiting requests that can be answered mean there is
+        // work to do without any input.
+        bool Runnable = false;
+        Fds.clear();
+        Fds.push_back({ListenFd, POLLIN, 0});
+        for (auto &C : Connections)
+        {
+            bool Backlogged = C.second.Out.size() >= MaxPendingOut;
+            bool Queued = HasRequest(C.second.In);
+            Runnable |= Queued && !Backlogged;
+
+            short Events = (C.second.ReadClosed || Backlogged || Queued) ? 0 : POLLIN;
+            if (!C.second.Out.empty())
+                Events |= POLLOUT;
+            Fds.push_back({C.first, Events, 0});
+        }
+
+        if (poll(Fds.data(), Fds.size(), Runnable ? 0 : -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LastError = std::string("poll: ") + strerror(errno);
+            return;
+        }
+
+        for (size_t i = 1; i < Fds.size(); ++i)
+        {
+            int Fd = Fds[i].fd;
+            Connection &C = Connections[Fd];
+            bool Ok = true;
+
+            if (!C.ReadClosed && (Fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                Ok = receive(Fd, C);
+            if (Ok)
+                Ok = process(C);
+            if (Ok && !C.Out.empty())    // try right away, most writes fit
+                Ok = send(Fd, C);
+
+            // A peer that has stopped sending still gets all its answers.
+            if (!Ok || (C.ReadClosed && C.Out.empty() && !HasRequest(C.In)))
+                close(Fd);
+        }
+
+        if (Fds[0].revents & POLLIN)
+            accept();
+        else if (Fds[0].revents & (POLLERR | POLLNVAL))
+        {
+            LastError = "Listening socket failed";
+            return;
+        }
+    }
+}
+
+void Server::accept()
+{
+    while (true)
+    {
+        int Fd = ::accept(ListenFd, nullptr, nullptr);
+        if (Fd < 0)
+            return;     // EAGAIN: no more pending connections
+
+        if (!SetNonBlocking(Fd))
+        {
+            ::close(Fd);
+            continue;
+        }
+        Connections[Fd];
+    }
+}
+
+// Read what is available, up to MaxReadPerTurn bytes. Returns false if the
+// connection is broken.
+bool Server::receive(int Fd, Connection &C)
+{
+    char Buf[64 * 1024];
+
+    for (size_t Total = 0; Total < MaxReadPerTurn;)
+    {
+        ssize_t N = read(Fd, Buf, sizeof(Buf));
+        if (N > 0)
+        {
+            C.In.append(Buf, N);
+            Total += N;
+        }
+        else if (N < 0 && errno == EINTR)
+            continue;
+        else if (N == 0)
+        {
+            C.ReadClosed = true;
+            break;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+// Answer up to MaxRequestsPerTurn complete requests, while there is room
+// for the answers. Returns false if a request is malformed.
+bool Server::process(Connection &C)
+{
+    size_t Pos = 0;
+    for (unsigned Handled = 0; Handled != MaxRequestsPerTurn && C.In.size() - Pos >= 8 &&
+                               C.Out.size() < MaxPendingOut; ++Handled)
+    {
+        uint32_t Id = ReadU32(&C.In[Pos]);
+        uint32_t Len = ReadU32(&C.In[Pos + 4]);
+        if (Len > MaxSourceLen)
+            return false;
+        if (C.In.size() - Pos - 8 < Len)
+            break;
+
+        handle(Id, &C.In[Pos + 8], Len, C.Out);
+        Pos += 8 + Len;
+    }
+    C.In.erase(0, Pos);
+
+    return true;
+}
+
+// Write as much of the pending output as the socket takes. Returns false
+// if the connection is broken.
+bool Server::send(int Fd, Connection &C)
+{
+    size_t Pos = 0;
+    while (Pos < C.Out.size())
+    {
+        ssize_t N = ::send(Fd, C.Out.data() + Pos, C.Out.size() - Pos, MSG_NOSIGNAL);
+        if (N < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        Pos += N;
+    }
+    C.Out.erase(0, Pos);
+
+    return true;
+}
+
+void Server::handle(uint32_t Id, const char *Source, uint32_t Len, std::string &Out)
+{
+    std::vector<double> Results;
+    bool Ok = E.compile(llvm::StringRef(Source, Len), &Results);
+    std::string Error = Ok ? std::string() : E.getLastError();
+
+    AppendU32(Out, Id);
+    AppendU32(Out, Ok ? 0 : 1);
+    AppendU32(Out, Results.size());
+    AppendU32(Out, Error.size());
+    Out.append((const char *)Results.data(), Results.size() * sizeof(double));
+    Out.append(Error);
+}
+
+void Server::close(int Fd)
+{
+    ::close(Fd);
+    Connections.erase(Fd);
+}
+
+} // namespace kaleidoscope
@@ -0,0 +1,84 @@
+#ifndef KALEIDOSCOPE_SERVER_H
+#define KALEIDOSCOPE_SERVER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "Engine.h"
+
+
+namespace kaleidoscope {
+
+/* Evaluation server
+ *
+ * Serves an Engine on a Unix domain socket. Every connection sends a stream
+ * of request frames and gets one response frame per request, in order, so a
+ * client may pipeline as many requests as it likes without waiting. All
+ * integers are in host byte order (the socket is local).
+ *
+ * Request:   uint32 Id, uint32 SourceLen, SourceLen bytes of Kaleidoscope
+ * Response:  uint32 Id, uint32 Status (0 ok, 1 error),
+ *            uint32 NumResults, uint32 ErrorLen,
+ *            NumResults doubles, ErrorLen bytes of error text
+ *
+ * The source of a request is handed to Engine::compile() as a whole, so it
+ * may hold any mix of definitions, externs and expressions; the results are
+ * the values of its top-level expressions. Definitions persist across
+ * requests and connections.
+ *
+ * Connections are multiplexed with poll() on one thread, which is also the
+ * thread compiling and running the code. Each connection gets a bounded
+ * turn per wakeup (MaxReadPerTurn bytes read, MaxRequestsPerTurn requests
+ * answered), and one whose unsent responses reach MaxPendingOut is not
+ * read from or answered until the client reads them, so a client that
+ * pipelines without reading can neither grow the buffers without bound
+ * nor starve the others.
+ */
+class Server
+{
+public:
+    static const uint32_t MaxSourceLen = 64 << 20;
+    static const size_t MaxPendingOut = 1 << 20;
+    static const size_t MaxReadPerTurn = 256 << 10;
+    static const unsigned MaxRequestsPerTurn = 16;
+
+    explicit Server(Engine &E) : E(E) {}
+    ~Server();
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    // Bind and listen on Path, replacing a stale socket file there.
+    bool listen(const std::string &Path);
+
+    // Serve connections until the listening socket fails.
+    void run();
+
+    const std::string &getLastError() const { return LastError; }
+
+private:
+    struct Connection
+    {
+        std::string In;     // bytes received, not yet a complete frame
+        std::string Out;    // responses not yet written
+        bool ReadClosed = false;
+    };
+
+    void accept();
+    bool receive(int Fd, Connection &C);
+    bool process(Connection &C);
+    bool send(int Fd, Connection &C);
+    void handle(uint32_t Id, const char *Source, uint32_t Len, std::string &Out);
+    void close(int Fd);
+
+    Engine &E;
+    int ListenFd = -1;
+    std::string Path;
+    std::map<int, Connection> Connections;
+    std::string LastError;
+};
+
+} // namespace kaleidoscope
+
+#endif
@@ -0,0 +1,142 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+
+namespace kaleidoscope {
+
+static const char *const StageNames[num_stages] = {
+    "item", "lex", "parse", "irgen", "passes", "codegen", "lookup", "execute"
+};
+
+static const char *const CounterNames[num_counters] = {
+    "AST nodes", "IR instructions", "code bytes"
+};
+
+// Name as a JSON string literal.
+static void WriteJSONString(FILE *Out, const std::string &Name)
+{
+    fputc('"', Out);
+    for (unsigned char C : Name)
+    {
+        if (C == '"' || C == '\\')
+            fprintf(Out, "\\%c", C);
+        else if (C < 0x20)
+            fprintf(Out, "\\u%04x", C);
+        else
+            fputc(C, Out);
+    }
+    fputc('"', Out);
+}
+
+
+void Timeline::add(Stage S, std::string Name, uint64_t Start, uint64_t End)
+{
+    std::lock_guard<std::mutex> Guard(Lock);
+    unsigned Thread = Threads.insert({std::this_thread::get_id(), (unsigned)Threads.size()})
+                          .first->second;
+    Events.push_back({S, std::move(Name), Start, End - Start, Thread});
+}
+
+void Timeline::count(Counter C, uint64_t N)
+{
+    uint64_t Time = now();
+    std::lock_guard<std::mutex> Guard(Lock);
+    Counters[C] += N;
+    Samples.push_back({C, Time, Counters[C]});
+}
+
+void Timeline::report(FILE *Out)
+{
+    std::lock_guard<std::mutex> Guard(Lock);
+
+    uint64_t StageTime[num_stages] = {};
+    unsigned StageEvents[num_stages] = {};
+    std::map<std::string, std::pair<uint64_t, unsigned>> PassTime;
+    for (auto &E : Events)
+    {
+        StageTime[E.S] += E.Dur;
+        ++StageEvents[E.S];
+        if (E.S == stage_pass)
+        {
+            PassTime[E.Name].first += E.Dur;
+            ++PassTime[E.Name].second;
+        }
+    }
+
+    // Stages do not overlap on a thread, so this is the time accounted for.
+    // With parallel definitions it can exceed the wall time.
+    uint64_t Total = 0;
+    for (unsigned S = stage_item + 1; S != num_stages; ++S)
+        Total += StageTime[S];
+    double Scale = Total ? 100.0 / Total : 0;
+
+    fprintf(Out, "%-44s %10s %8s %6s\n", "stage", "ms", "events", "%");
+    for (unsigned S = stage_item + 1; S != num_stages; ++S)
+    {
+        fprintf(Out, "%-44s %10.3f %8u %6.1f\n", StageNames[S], StageTime[S] / 1e6,
+                StageEvents[S], StageTime[S] * Scale);
+
+        if (S != stage_pass)
+            continue;
+
+        using PassRow = std::pair<std::string, std::pair<uint64_t, unsigned>>;
+        std::vector<PassRow> Passes(PassTime.begin(), PassTime.end());
+        std::sort(Passes.begin(), Passes.end(), [](const PassRow &A, const PassRow &B) {
+            return A.second.first > B.second.first;
+        });
+        for (auto &P : Passes)
+            fprintf(Out, "  %-42s %10.3f %8u %6.1f\n", P.first.substr(0, 42).c_str(),
+                    P.second.first / 1e6, P.second.second, P.second.first * Scale);
+    }
+    fprintf(Out, "%-44s %10.3f\n", "total", Total / 1e6);
+
+    fprintf(Out, "%u items", StageEvents[stage_item]);
+    for (unsigned C = 0; C != num_counters; ++C)
+        fprintf(Out, ", %llu %s", (unsigned long long)Counters[C], CounterNames[C]);
+    fprintf(Out, "\n");
+}
+
+bool Timeline::writeChromeTrace(const std::string &Path, std::string &Error)
+{
+    FILE *Out = fopen(Path.c_str(), "w");
+    if (!Out)
+    {
+        Error = Path + ": " + strerror(errno);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+
+    // Complete ("X") events in microseconds; the viewer nests them by time.
+    fprintf(Out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *Sep = "";
+    for (auto &E : Events)
+    {
+        fprintf(Out, "%s{\"name\":", Sep);
+        WriteJSONString(Out, E.Name.empty() ? StageNames[E.S] : E.Name);
+        fprintf(Out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                StageNames[E.S], E.Start / 1e3, E.Dur / 1e3, E.Thread);
+        Sep = ",\n";
+    }
+
+    // Counters ("C" events), drawn as graphs over time.
+    for (auto &S : Samples)
+    {
+        fprintf(Out, "%s{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"value\":%llu}}",
+                Sep, CounterNames[S.C], S.Time / 1e3, (unsigned long long)S.Value);
+        Sep = ",\n";
+    }
+    fprintf(Out, "\n]}\n");
+
+    if (fclose(Out) != 0)
+    {
+        Error = Path + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+} // namespace kaleidoscope
@@ -0,0 +1,128 @@
+#ifndef KALEIDOSCOPE_TRACE_H
+#define KALEIDOSCOPE_TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <llvm/ADT/StringRef.h>
+
+
+namespace kaleidoscope {
+
+/* Timeline
+ *
+ * Where an Engine spends its time, recorded only with EngineOptions::Timing
+ * or TraceFile: an event per stage of each top-level item (parsing, IR
+ * generation, each optimization pass, machine code, symbol lookup and
+ * running it), lexing per compile(), and running counts of AST nodes, IR
+ * instructions and code bytes. report() sums the events up by stage and
+ * pass; writeChromeTrace() writes all of them in the Chrome trace-event
+ * format, for chrome://tracing or Perfetto.
+ *
+ * Events can come from several threads (parallel definitions); each
+ * thread is a row of its own in the trace.
+ */
+enum Stage : uint8_t
+{
+    stage_item,     // a whole top-level item; the others nest inside one
+    stage_lex,
+    stage_parse,
+    stage_irgen,
+    stage_pass,     // one pass, or a run of loop passes
+    stage_codegen,  // IR to machine code
+    stage_lookup,   // symbol lookup, which links objects on first use
+    stage_execute,
+    num_stages
+};
+
+enum Counter : uint8_t
+{
+    counter_ast_nodes,
+    counter_ir_insts,
+    counter_code_bytes,
+    num_counters
+};
+
+class Timeline
+{
+    struct Event
+    {
+        Stage S;
+        std::string Name;
+        uint64_t Start, Dur;    // ns since the timeline was created
+        unsigned Thread;
+    };
+
+    struct Sample
+    {
+        Counter C;
+        uint64_t Time, Value;
+    };
+
+    const std::chrono::steady_clock::time_point Epoch = std::chrono::steady_clock::now();
+
+    std::mutex Lock;
+    std::vector<Event> Events;
+    std::vector<Sample> Samples;
+    std::map<std::thread::id, unsigned> Threads;
+    uint64_t Counters[num_counters] = {};
+
+public:
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - Epoch).count();
+    }
+
+    void add(Stage S, std::string Name, uint64_t Start, uint64_t End);
+    void count(Counter C, uint64_t N);
+
+    // Time per stage and per pass, and the counters.
+    void report(FILE *Out);
+
+    // False, with Error set, if Path cannot be written.
+    bool writeChromeTrace(const std::string &Path, std::string &Error);
+};
+
+// Records the enclosing scope, or up to stop(), as an event on T. Does
+// nothing if T is null.
+class TimeScope
+{
+    Timeline *T;
+    Stage S;
+    std::string Name;
+    uint64_t Start;
+
+public:
+    TimeScope(Timeline *T, Stage S, llvm::StringRef Name)
+        : T(T), S(S), Name(T ? Name.str() : std::string()), Start(T ? T->now() : 0) {}
+
+    ~TimeScope()
+    {
+        stop();
+    }
+
+    // For items, whose name is only known once they are parsed.
+    void setName(llvm::StringRef N)
+    {
+        if (T)
+            Name = N.str();
+    }
+
+    void stop()
+    {
+        if (T)
+            T->add(S, std::move(Name), Start, T->now());
+        T = nullptr;
+    }
+};
+
+} // namespace kaleidoscope
+
+#endif
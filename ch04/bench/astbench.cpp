@@ -0,0 +1,331 @@
+// Expression tree layouts: a tree of heap nodes with a virtual call per
+// node (the AST Engine.cpp had before AST.h), and the flat ExprPool.
+// Each builds the same large function body, then
+//
+//   walk - evaluates it, which is just the traversal
+//   emit - generates LLVM IR for it, as codegen does
+//
+// and reports time, nodes per second and, where perf events are
+// available, last-level cache misses.
+//
+//   clang++-10 -O3 -o astbench bench/astbench.cpp `llvm-config-10 --cxxflags --ldflags --libs core`
+//   ./astbench [depth]
+//
+// The heap is churned before either is built, as it would be after a
+// session has compiled for a while, so tree nodes do not simply land one
+// after another.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include "../AST.h"
+
+using namespace kaleidoscope;
+
+
+/* The pointer tree */
+struct Emitter
+{
+    llvm::IRBuilder<> &B;
+    llvm::Function *Callee;
+    llvm::Value *Args[4];
+};
+
+class TreeExpr
+{
+public:
+    virtual ~TreeExpr()
+    {}
+    virtual double eval(const double *Vars) const = 0;
+    virtual llvm::Value *emit(Emitter &E) const = 0;
+};
+
+class TreeNumber : public TreeExpr
+{
+    double Val;
+
+public:
+    TreeNumber(double val) : Val(val) {}
+    virtual double eval(const double *) const { return Val; }
+    virtual llvm::Value *emit(Emitter &E) const
+    {
+        return llvm::ConstantFP::get(E.B.getDoubleTy(), Val);
+    }
+};
+
+class TreeVariable : public TreeExpr
+{
+    std::string Name;
+    int Slot;
+
+public:
+    TreeVariable(const std::string &name, int slot) : Name(name), Slot(slot) {}
+    virtual double eval(const double *Vars) const { return Vars[Slot]; }
+    virtual llvm::Value *emit(Emitter &E) const { return E.Args[Slot]; }
+};
+
+class TreeBinary : public TreeExpr
+{
+    char Op;
+    std::unique_ptr<TreeExpr> LHS, RHS;
+
+public:
+    TreeBinary(char op, std::unique_ptr<TreeExpr> lhs, std::unique_ptr<TreeExpr> rhs)
+        : Op(op), LHS(std::move(lhs)), RHS(std::move(rhs)) {}
+
+    virtual double eval(const double *Vars) const
+    {
+        double L = LHS->eval(Vars), R = RHS->eval(Vars);
+        return Op == '+' ? L + R : Op == '-' ? L - R : L * R;
+    }
+
+    virtual llvm::Value *emit(Emitter &E) const
+    {
+        llvm::Value *L = LHS->emit(E), *R = RHS->emit(E);
+        return Op == '+' ? E.B.CreateFAdd(L, R) : Op == '-' ? E.B.CreateFSub(L, R)
+                                                            : E.B.CreateFMul(L, R);
+    }
+};
+
+class TreeCall : public TreeExpr
+{
+    std::string Callee;
+    std::vector<std::unique_ptr<TreeExpr>> Args;
+
+public:
+    TreeCall(const std::string &callee, std::vector<std::unique_ptr<TreeExpr>> args)
+        : Callee(callee), Args(std::move(args)) {}
+
+    virtual double eval(const double *Vars) const
+    {
+        return Args[0]->eval(Vars) * 0.5;
+    }
+
+    virtual llvm::Value *emit(Emitter &E) const
+    {
+        return E.B.CreateCall(E.Callee, {Args[0]->emit(E)});
+    }
+};
+
+
+/* The same operations over an ExprPool */
+static double Eval(const ExprPool &P, ExprId Id, const double *Vars)
+{
+    const ExprNode &N = P[Id];
+    switch (N.Kind)
+    {
+    case ek_number:
+        return P.getLiteral(N);
+    case ek_variable:
+        return Vars[N.Name];
+    case ek_binary:
+    {
+        double L = Eval(P, N.Kid[0], Vars), R = Eval(P, N.Kid[1], Vars);
+        return N.Op == '+' ? L + R : N.Op == '-' ? L - R : L * R;
+    }
+    case ek_call:
+        return Eval(P, P.getArgs(N)[0], Vars) * 0.5;
+    default:
+        return 0;
+    }
+}
+
+static llvm::Value *Emit(const ExprPool &P, ExprId Id, Emitter &E)
+{
+    const ExprNode &N = P[Id];
+    switch (N.Kind)
+    {
+    case ek_number:
+        return llvm::ConstantFP::get(E.B.getDoubleTy(), P.getLiteral(N));
+    case ek_variable:
+        return E.Args[N.Name];
+    case ek_binary:
+    {
+        llvm::Value *L = Emit(P, N.Kid[0], E), *R = Emit(P, N.Kid[1], E);
+        return N.Op == '+' ? E.B.CreateFAdd(L, R) : N.Op == '-' ? E.B.CreateFSub(L, R)
+                                                                : E.B.CreateFMul(L, R);
+    }
+    case ek_call:
+        return E.B.CreateCall(E.Callee, {Emit(P, P.getArgs(N)[0], E)});
+    default:
+        return nullptr;
+    }
+}
+
+
+/* Input: a random expression over four variables, built into both */
+static const char *const VarNames[] = {"x", "y", "z", "w"};
+
+struct Builder
+{
+    std::mt19937_64 Rng{42};
+    ExprPool Pool;
+    size_t Nodes = 0;
+
+    // Variable names get ids 0-3, so they double as argument slots.
+    Builder()
+    {
+        for (const char *Name : VarNames)
+            Pool.intern(Name);
+    }
+
+    // Both layouts are built in the same order, the parser's: operands
+    // before the node that uses them.
+    void build(int Depth, std::unique_ptr<TreeExpr> &Tree, ExprId &Flat)
+    {
+        ++Nodes;
+        unsigned R = Rng() % 16;
+        if (Depth == 0 || R == 0)
+        {
+            if (R & 1)
+            {
+                double V = (double)(Rng() % 1000) / 8;
+                Tree.reset(new TreeNumber(V));
+                Flat = Pool.addNumber(V);
+            }
+            else
+            {
+                int Slot = Rng() % 4;
+                Tree.reset(new TreeVariable(VarNames[Slot], Slot));
+                Flat = Pool.addVariable(VarNames[Slot]);
+            }
+            return;
+        }
+
+        if (R == 1)
+        {
+            std::vector<std::unique_ptr<TreeExpr>> Args(1);
+            ExprId Arg;
+            build(Depth - 1, Args[0], Arg);
+            Tree.reset(new TreeCall("half", std::move(Args)));
+            Flat = Pool.addCall("half", Arg);
+            return;
+        }
+
+        static const char Ops[] = {'+', '-', '*'};
+        char Op = Ops[Rng() % 3];
+        std::unique_ptr<TreeExpr> L, RT;
+        ExprId FL, FR;
+        build(Depth - 1, L, FL);
+        build(Depth - 1, RT, FR);
+        Tree.reset(new TreeBinary(Op, std::move(L), std::move(RT)));
+        Flat = Pool.addBinary(Op, FL, FR);
+    }
+};
+
+// Leaves holes of assorted sizes all over the heap.
+static std::vector<std::unique_ptr<char[]>> ChurnHeap()
+{
+    std::mt19937 Rng(7);
+    std::vector<std::unique_ptr<char[]>> Blocks;
+    for (int i = 0; i < 1 << 20; ++i)
+        Blocks.emplace_back(new char[16 + Rng() % 96]);
+    for (size_t i = 0; i < Blocks.size(); i += 2)
+        Blocks[i].reset();
+    return Blocks;
+}
+
+
+/* Measurement */
+static int OpenCacheMissCounter()
+{
+    perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    Attr.disabled = 1;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &Attr, 0, -1, -1, 0);
+}
+
+static const int Counter = OpenCacheMissCounter();   // -1 if unavailable
+
+template<typename Fn>
+static void Run(const char *Name, size_t Nodes, Fn &&Body)
+{
+    double Best = 1e30;
+    long long Misses = -1;
+    for (int i = 0; i < 5; ++i)
+    {
+        if (Counter >= 0)
+        {
+            ioctl(Counter, PERF_EVENT_IOC_RESET, 0);
+            ioctl(Counter, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        auto T0 = std::chrono::steady_clock::now();
+        Body();
+        std::chrono::duration<double> T = std::chrono::steady_clock::now() - T0;
+        if (Counter >= 0)
+        {
+            ioctl(Counter, PERF_EVENT_IOC_DISABLE, 0);
+            long long Count;
+            if (read(Counter, &Count, sizeof(Count)) == sizeof(Count) &&
+                (Misses < 0 || Count < Misses))
+                Misses = Count;
+        }
+        Best = std::min(Best, T.count());
+    }
+
+    printf("%-12s %8.2f ms  %7.1f Mnodes/s", Name, Best * 1e3, Nodes / Best / 1e6);
+    if (Misses >= 0)
+        printf("  %6.3f cache misses/node", (double)Misses / Nodes);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int Depth = argc > 1 ? atoi(argv[1]) : 20;
+
+    auto Churn = ChurnHeap();
+    Builder B;
+    std::unique_ptr<TreeExpr> Tree;
+    ExprId Root;
+    B.build(Depth, Tree, Root);
+    printf("%zu nodes, %.1f MB as a pool\n", B.Nodes,
+           B.Pool.size() * sizeof(ExprNode) / 1048576.0);
+
+    const double Vars[4] = {1.5, -2.25, 0.125, 3};
+    volatile double Sink;
+    Run("tree walk", B.Nodes, [&]() { Sink = Tree->eval(Vars); });
+    Run("pool walk", B.Nodes, [&]() { Sink = Eval(B.Pool, Root, Vars); });
+
+    // One function per run, emitted into a fresh module.
+    llvm::LLVMContext Context;
+    auto EmitInto = [&](bool UsePool) {
+        llvm::Module M("astbench", Context);
+        llvm::IRBuilder<> IRB(Context);
+        auto *D = IRB.getDoubleTy();
+        auto *Half = llvm::Function::Create(llvm::FunctionType::get(D, {D}, false),
+                                            llvm::Function::ExternalLinkage, "half", &M);
+        auto *F = llvm::Function::Create(llvm::FunctionType::get(D, {D, D, D, D}, false),
+                                         llvm::Function::ExternalLinkage, "body", &M);
+        IRB.SetInsertPoint(llvm::BasicBlock::Create(Context, "Entry", F));
+
+        Emitter E{IRB, Half, {}};
+        for (unsigned i = 0; i != 4; ++i)
+            E.Args[i] = F->getArg(i);
+        IRB.CreateRet(UsePool ? Emit(B.Pool, Root, E) : Tree->emit(E));
+    };
+    Run("tree emit", B.Nodes, [&]() { EmitInto(false); });
+    Run("pool emit", B.Nodes, [&]() { EmitInto(true); });
+
+    (void)Sink;
+    return 0;
+}
@@ -0,0 +1,82 @@
+// Compile throughput of a script of many small definitions and expressions
+// when silent (the default) and at each verbosity, which is what the REPL
+// used to print for every item.
+//
+//   clang++-10 -O3 -rdynamic -o dumpbench bench/dumpbench.cpp libkaleidoscope.a `llvm-config-10 --cxxflags --ldflags --system-libs --libs`
+//   ./dumpbench [definitions] 2>/dev/null
+//
+// With stderr on /dev/null this only measures formatting the IR; writing it
+// to a terminal or a pipe costs more again.
+//
+// Best of 3, in ms, for the default 2000 definitions and 2000 expressions
+// on a 1-CPU x86-64 VM (LLVM 14 build), stderr on /dev/null and on a file
+// (2.2 MB per -v=2 run):
+//
+//                 -v=0    -v=1    -v=2
+//   /dev/null    12561   10312   13189
+//   file         12930   13701   12706
+//
+// About 3 ms per item goes to optimizing, code generation and linking
+// each item's module, and printing is lost in the noise of that. It only
+// shows when stderr is slow to write, such as a terminal.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../Engine.h"
+
+using namespace kaleidoscope;
+
+
+static std::string MakeScript(int N)
+{
+    std::string S;
+    char Buf[256];
+    for (int i = 0; i < N; ++i)
+    {
+        snprintf(Buf, sizeof(Buf),
+                 "def f%d(x y) if x < %d then x * y + %d else f%d(x - 1, y * 0.5) + y;\n"
+                 "f%d(%d, 2);\n",
+                 i, i, i, i, i, i % 7);
+        S += Buf;
+    }
+    return S;
+}
+
+int main(int argc, char **argv)
+{
+    int N = argc > 1 ? atoi(argv[1]) : 2000;
+
+    std::string Script = MakeScript(N);
+    printf("%d definitions, %d expressions\n", N, N);
+
+    double Base = 0;
+    for (unsigned Verbosity = 0; Verbosity <= 2; ++Verbosity)
+    {
+        EngineOptions Opts;
+        Opts.Verbosity = Verbosity;
+
+        double Best = 1e30;
+        for (int i = 0; i < 3; ++i)
+        {
+            Engine E(Opts);
+            auto T0 = std::chrono::steady_clock::now();
+            if (!E.compile(Script))
+            {
+                fprintf(stderr, "%s\n", E.getLastError().c_str());
+                return 1;
+            }
+            std::chrono::duration<double> T = std::chrono::steady_clock::now() - T0;
+            Best = std::min(Best, T.count());
+        }
+
+        if (Verbosity == 0)
+            Base = Best;
+        printf("-v=%u %8.1f ms  %8.0f items/s  %5.2fx the silent time\n", Verbosity,
+               Best * 1e3, 2 * N / Best, Best / Base);
+    }
+    return 0;
+}
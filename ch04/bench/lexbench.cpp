@@ -0,0 +1,141 @@
+// Lexer scanning throughput, in MB/s, for each implementation in Scan.h
+// and for the <cctype> loops the lexer used before.
+//
+//   clang++-10 -O3 -o lexbench bench/lexbench.cpp && ./lexbench [MB]
+//
+// The input is generated Kaleidoscope: indented definitions with long
+// identifiers, comment lines and numbers, repeated up to the given size.
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../Scan.h"
+
+using namespace kaleidoscope;
+
+
+// Tokenize [P, End) the way gettok() does and return the token count.
+template<const char *(*Space)(const char *, const char *),
+         const char *(*Alnum)(const char *, const char *),
+         const char *(*Number)(const char *, const char *),
+         const char *(*Comment)(const char *, const char *)>
+static size_t CountTokens(const char *P, const char *End)
+{
+    size_t N = 0;
+    while (true)
+    {
+        P = Space(P, End);
+        if (P == End)
+            return N;
+
+        if (isalpha((unsigned char)*P))
+            P = Alnum(P + 1, End);
+        else if (isdigit((unsigned char)*P) || *P == '.')
+            P = Number(P + 1, End);
+        else if (*P == '#')
+        {
+            P = Comment(P, End);
+            continue;
+        }
+        else
+            ++P;
+        ++N;
+    }
+}
+
+// The character loops gettok() had before Scan.h.
+static const char *CtypeSpace(const char *P, const char *End)
+{
+    while (P != End && isspace((unsigned char)*P))
+        ++P;
+    return P;
+}
+
+static const char *CtypeAlnum(const char *P, const char *End)
+{
+    while (P != End && isalnum((unsigned char)*P))
+        ++P;
+    return P;
+}
+
+static const char *CtypeNumber(const char *P, const char *End)
+{
+    while (P != End && (isdigit((unsigned char)*P) || *P == '.'))
+        ++P;
+    return P;
+}
+
+static const char *CtypeComment(const char *P, const char *End)
+{
+    while (P != End && *P != '\n' && *P != '\r')
+        ++P;
+    return P;
+}
+
+static std::string Generate(size_t Size)
+{
+    const char *Chunk =
+        "# Sum of the elements of a buffer, with a running correction term\n"
+        "# so that long buffers of small values do not lose precision.\n"
+        "def compensatedSum(buffer:f64[] elementCount:i64)\n"
+        "    var total = 0, correction = 0 in\n"
+        "        (for index:i64 = 0, index < elementCount in\n"
+        "            total = total + buffer[index] * 1.000001 - correction * 0.5)\n"
+        "        : total;\n"
+        "\n"
+        "compensatedSum(newf64(1048576), 1048576);\n";
+
+    std::string S;
+    while (S.size() < Size)
+        S += Chunk;
+    return S;
+}
+
+template<size_t (*Count)(const char *, const char *)>
+static void Run(const char *Name, const std::string &Src)
+{
+    size_t Tokens = 0;
+    double Best = 1e30;
+    for (int i = 0; i < 5; ++i)
+    {
+        auto T0 = std::chrono::steady_clock::now();
+        Tokens = Count(Src.data(), Src.data() + Src.size());
+        std::chrono::duration<double> T = std::chrono::steady_clock::now() - T0;
+        Best = std::min(Best, T.count());
+    }
+    printf("%-8s %8.1f MB/s  (%zu tokens)\n", Name, Src.size() / Best / 1e6, Tokens);
+}
+
+int main(int argc, char **argv)
+{
+    size_t MB = argc > 1 ? atoi(argv[1]) : 64;
+    std::string Src = Generate(MB << 20);
+
+    Run<CountTokens<CtypeSpace, CtypeAlnum, CtypeNumber, CtypeComment>>("ctype", Src);
+    Run<CountTokens<skipScalar<cc_space>, skipScalar<cc_alnum>, skipScalar<cc_number>,
+                    skipScalar<cc_not_line_end>>>("scalar", Src);
+#ifdef KALEIDOSCOPE_SCAN_X86
+    Run<CountTokens<skipSSE2<cc_space>, skipSSE2<cc_alnum>, skipSSE2<cc_number>,
+                    skipSSE2<cc_not_line_end>>>("sse2", Src);
+    Run<CountTokens<skipHybrid<cc_space, skipSSE2<cc_space>>,
+                    skipHybrid<cc_alnum, skipSSE2<cc_alnum>>,
+                    skipHybrid<cc_number, skipSSE2<cc_number>>,
+                    skipHybrid<cc_not_line_end, skipSSE2<cc_not_line_end>>>>("hyb-sse2", Src);
+    if (__builtin_cpu_supports("avx2"))
+    {
+        Run<CountTokens<skipAVX2<cc_space>, skipAVX2<cc_alnum>, skipAVX2<cc_number>,
+                        skipAVX2<cc_not_line_end>>>("avx2", Src);
+        Run<CountTokens<skipHybrid<cc_space, skipAVX2<cc_space>>,
+                        skipHybrid<cc_alnum, skipAVX2<cc_alnum>>,
+                        skipHybrid<cc_number, skipAVX2<cc_number>>,
+                        skipHybrid<cc_not_line_end, skipAVX2<cc_not_line_end>>>>("hyb-avx2", Src);
+    }
+#endif
+    Run<CountTokens<skip<cc_space>, skip<cc_alnum>, skip<cc_number>,
+                    skip<cc_not_line_end>>>("skip", Src);
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Number literal conversion speed: std::stod on a temporary string (the
+// lexer's old way), strtod from a stack buffer, and parseNumber().
+// Also checks that parseNumber() agrees with strtod bit for bit.
+//
+//   clang++-10 -O3 -o numbench bench/numbench.cpp `llvm-config-10 --cxxflags --ldflags --libs support`
+//   ./numbench [count]
+//
+// Literals are a mix of the shapes found in Kaleidoscope sources: small
+// integers, short decimals, and long decimals that need the slow path.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../Number.h"
+
+using namespace kaleidoscope;
+
+
+static std::vector<std::string> Generate(size_t Count)
+{
+    std::mt19937_64 Rng(42);
+    std::vector<std::string> Literals;
+
+    for (size_t i = 0; i < Count; ++i)
+    {
+        std::string S;
+        switch (Rng() % 4)
+        {
+        case 0:     // loop bounds, indices
+            S = std::to_string(Rng() % 100000);
+            break;
+        case 1:     // short decimals
+            S = std::to_string(Rng() % 1000) + "." + std::to_string(Rng() % 1000);
+            break;
+        case 2:     // leading '.', trailing '.'
+            S = (Rng() & 1) ? "." + std::to_string(Rng() % 100000)
+                            : std::to_string(Rng() % 100000) + ".";
+            break;
+        case 3:     // long decimals, past the fast path
+            S = std::to_string(Rng()) + "." + std::to_string(Rng());
+            break;
+        }
+        Literals.push_back(S);
+    }
+    return Literals;
+}
+
+static double WithStod(const std::string &S)
+{
+    std::string NumStr(S.data(), S.size());
+    return std::stod(NumStr, 0);
+}
+
+static double WithStrtod(const std::string &S)
+{
+    char Buf[64];
+    memcpy(Buf, S.data(), S.size());
+    Buf[S.size()] = '\0';
+    return strtod(Buf, nullptr);
+}
+
+static double WithParseNumber(const std::string &S)
+{
+    double D = 0;
+    parseNumber(S.data(), S.data() + S.size(), D);
+    return D;
+}
+
+template<double (*Convert)(const std::string &)>
+static void Run(const char *Name, const std::vector<std::string> &Literals, size_t Bytes)
+{
+    double Best = 1e30, Sum = 0;
+    for (int i = 0; i < 5; ++i)
+    {
+        Sum = 0;
+        auto T0 = std::chrono::steady_clock::now();
+        for (auto &S : Literals)
+            Sum += Convert(S);
+        std::chrono::duration<double> T = std::chrono::steady_clock::now() - T0;
+        Best = std::min(Best, T.count());
+    }
+    printf("%-12s %7.1f MB/s  %6.1f ns/literal  (sum %g)\n", Name, Bytes / Best / 1e6,
+           Best * 1e9 / Literals.size(), Sum);
+}
+
+int main(int argc, char **argv)
+{
+    size_t Count = argc > 1 ? atoi(argv[1]) : 2000000;
+    auto Literals = Generate(Count);
+
+    size_t Bytes = 0, Mismatches = 0;
+    for (auto &S : Literals)
+    {
+        Bytes += S.size();
+        double A = WithStrtod(S), B = WithParseNumber(S);
+        if (memcmp(&A, &B, sizeof(double)))
+            ++Mismatches;
+    }
+    printf("%zu literals, %zu bytes, %zu mismatches against strtod\n",
+           Literals.size(), Bytes, Mismatches);
+
+    Run<WithStod>("std::stod", Literals, Bytes);
+    Run<WithStrtod>("strtod", Literals, Bytes);
+    Run<WithParseNumber>("parseNumber", Literals, Bytes);
+
+    return Mismatches != 0;
+}
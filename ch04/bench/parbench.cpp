@@ -0,0 +1,108 @@
+// Compile time of a script of many definitions with EngineOptions::Jobs at
+// 1, 2, 4 and 8, and the speedup over Jobs = 1. More jobs than hardware
+// threads only show what the batching costs.
+//
+//   clang++-10 -O3 -rdynamic -o parbench bench/parbench.cpp libkaleidoscope.a `llvm-config-10 --cxxflags --ldflags --system-libs --libs`
+//   ./parbench [definitions] [-ipo] 2>/dev/null
+//
+// The script is the kind parallel compilation is for: mostly independent
+// definitions with sizeable bodies, plus a layer calling into them, which
+// has to wait for its callees.
+//
+// Two runs of the default 400 definitions, best of 3 each, in ms, on a
+// 1-CPU x86-64 VM (LLVM 14 build):
+//
+//              jobs 1   jobs 2   jobs 4   jobs 8
+//   plain        6823     6952     6272     5952
+//                5752     5856     5923     5708
+//   -ipo         6636     7942     7581     8843
+//                6929     5904     6042     6834
+//
+// With one CPU there is no speedup to be had, and the runs differ by up to
+// 20%, more than any difference between job counts. What it does show is
+// that the batching itself (parsing a run first, a context and pass
+// managers per worker) costs no more than that noise.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "../Engine.h"
+
+using namespace kaleidoscope;
+
+
+static std::string MakeScript(int N)
+{
+    std::string S;
+    char Buf[256];
+    for (int i = 0; i < N; ++i)
+    {
+        snprintf(Buf, sizeof(Buf), "def work%d(x:f64 n:i64)\n"
+                 "    var a = x, b = %d in\n", i, i);
+        S += Buf;
+        S += "    (for k = 0, k < n in\n";
+        for (int j = 0; j < 24; ++j)
+        {
+            snprintf(Buf, sizeof(Buf), "        (a = a * %d.5 + b - %d) : (b = b * a - %d) :\n",
+                     j + 1, i + j, j);
+            S += Buf;
+        }
+        S += "        0) : a + b;\n";
+    }
+
+    // Each caller depends on four of the definitions above.
+    for (int i = 0; i + 4 <= N; i += 4)
+    {
+        snprintf(Buf, sizeof(Buf),
+                 "def sum%d(x) work%d(x, 2) + work%d(x, 2) + work%d(x, 2) + work%d(x, 2);\n",
+                 i, i, i + 1, i + 2, i + 3);
+        S += Buf;
+    }
+    return S;
+}
+
+int main(int argc, char **argv)
+{
+    int N = argc > 1 ? atoi(argv[1]) : 400;
+    bool IPO = argc > 2 && !strcmp(argv[2], "-ipo");
+
+    std::string Script = MakeScript(N);
+    printf("%d definitions, %u hardware threads%s\n", N,
+           std::thread::hardware_concurrency(), IPO ? ", -ipo" : "");
+
+    double Base = 0;
+    for (unsigned Jobs : {1u, 2u, 4u, 8u})
+    {
+        EngineOptions Opts;
+        Opts.IPO = IPO;
+        Opts.Jobs = Jobs;
+
+        double Best = 1e30;
+        for (int i = 0; i < 3; ++i)
+        {
+            Engine E(Opts);
+            auto T0 = std::chrono::steady_clock::now();
+            if (!E.compile(Script))
+            {
+                fprintf(stderr, "%s\n", E.getLastError().c_str());
+                return 1;
+            }
+
+            // Make sure every definition is linked, in case the JIT is lazy.
+            for (int k = 0; k < N; ++k)
+                E.lookup<double(double, int64_t)>("work" + std::to_string(k));
+            std::chrono::duration<double> T = std::chrono::steady_clock::now() - T0;
+            Best = std::min(Best, T.count());
+        }
+
+        if (Jobs == 1)
+            Base = Best;
+        printf("jobs %-3u %8.1f ms  %5.2fx\n", Jobs, Best * 1e3, Base / Best);
+    }
+    return 0;
+}
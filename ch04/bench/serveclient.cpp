@@ -0,0 +1,131 @@
+// Pipelining client for "toy -serve": sends a definition, a request that
+// fails, then the given number of expressions calling the definition, all
+// without waiting for a response, and checks that every response comes
+// back in order with the expected value or error. Prints the requests per
+// second it saw.
+//
+//   clang++-10 -O3 -pthread -o serveclient bench/serveclient.cpp
+//   ./toy -serve=/tmp/k.sock &
+//   ./serveclient /tmp/k.sock [count]
+//
+// Requests are written from a thread of their own while the main thread
+// reads, since the server stops reading a connection whose unread
+// responses pile up.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+static void AppendU32(std::string &Out, uint32_t V)
+{
+    Out.append((const char *)&V, sizeof(V));
+}
+
+static void AppendRequest(std::string &Out, uint32_t Id, const std::string &Source)
+{
+    AppendU32(Out, Id);
+    AppendU32(Out, Source.size());
+    Out += Source;
+}
+
+static bool ReadAll(int Fd, void *Buf, size_t Len)
+{
+    char *P = (char *)Buf;
+    while (Len)
+    {
+        ssize_t N = read(Fd, P, Len);
+        if (N <= 0)
+            return false;
+        P += N;
+        Len -= N;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <socket> [count]\n", argv[0]);
+        return 1;
+    }
+    int Count = argc > 2 ? atoi(argv[2]) : 100000;
+
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    strncpy(Addr.sun_path, argv[1], sizeof(Addr.sun_path) - 1);
+
+    int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Fd < 0 || connect(Fd, (sockaddr *)&Addr, sizeof(Addr)) != 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // Id 0 defines sc, id 1 fails, ids 2.. evaluate sc(i) = 2i + 1.
+    std::string Out;
+    AppendRequest(Out, 0, "def sc(x) x * 2 + 1;");
+    AppendRequest(Out, 1, "sc(;");
+    for (int i = 0; i < Count; ++i)
+        AppendRequest(Out, i + 2, "sc(" + std::to_string(i) + ");");
+
+    auto T0 = std::chrono::steady_clock::now();
+    std::thread Writer([&] {
+        size_t Pos = 0;
+        while (Pos < Out.size())
+        {
+            ssize_t N = write(Fd, Out.data() + Pos, Out.size() - Pos);
+            if (N <= 0)
+                break;
+            Pos += N;
+        }
+        shutdown(Fd, SHUT_WR);
+    });
+
+    int Errors = 0;
+    uint32_t Expected = 0;
+    for (; Expected < (uint32_t)Count + 2; ++Expected)
+    {
+        uint32_t Header[4];     // Id, Status, NumResults, ErrorLen
+        if (!ReadAll(Fd, Header, sizeof(Header)))
+            break;
+        std::vector<double> Results(Header[2]);
+        std::string Error(Header[3], '\0');
+        if (!ReadAll(Fd, Results.data(), Results.size() * sizeof(double)) ||
+            !ReadAll(Fd, &Error[0], Error.size()))
+            break;
+
+        bool Ok;
+        if (Expected == 0)
+            Ok = Header[1] == 0 && Results.empty();
+        else if (Expected == 1)
+            Ok = Header[1] == 1 && !Error.empty();
+        else
+            Ok = Header[1] == 0 && Results.size() == 1 && Results[0] == 2.0 * (Expected - 2) + 1;
+
+        if (Header[0] != Expected || !Ok)
+        {
+            if (++Errors <= 10)
+                fprintf(stderr, "response %u: id %u, status %u, %u results, error \"%s\"\n",
+                        Expected, Header[0], Header[1], Header[2], Error.c_str());
+        }
+    }
+    std::chrono::duration<double> T = std::chrono::steady_clock::now() - T0;
+
+    Writer.join();
+    close(Fd);
+
+    printf("%u of %d responses, %d wrong, %.3f s, %.0f requests/s\n",
+           Expected, Count + 2, Errors, T.count(), Expected / T.count());
+    return Expected == (uint32_t)Count + 2 && Errors == 0 ? 0 : 1;
+}
@@ -1 +1,5 @@
-clang++-10 -g -O3 toy.cpp `llvm-config-10 --cxxflags --ldflags --system-libs --libs`
\ No newline at end of file
+for src in Engine Server Trace; do
+    clang++-10 -g -O3 -Wall -c $src.cpp `llvm-config-10 --cxxflags` || exit 1
+done
+ar rcs libkaleidoscope.a Engine.o Server.o Trace.o
+clang++-10 -g -O3 -Wall -rdynamic toy.cpp libkaleidoscope.a `llvm-config-10 --cxxflags --ldflags --system-libs --libs`
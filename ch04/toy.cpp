@@ -1,711 +1,217 @@
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
 #include <string>
-#include <cctype>
-#include <memory>
 #include <vector>
-#include <unordered_map>
 
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/ADT/APFloat.h>
-#include <llvm/IR/Function.h>
-#include <llvm/IR/Verifier.h>
-#include <llvm/ADT/STLExtras.h>
-#include <llvm/IR/LegacyPassManager.h>
-#include "../include/KaleidoscopeJIT.h"
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Target/TargetMachine.h>
-#include <llvm/Support/TargetSelect.h>
-
-
-
-enum Token {
-    tok_eof=-1,
-
-    tok_def=-2,
-    tok_extern=-3,
-
-    tok_identifier=-4, //IdentifierStr
-    tok_number=-5   //NumVal
-};
-
-
-static std::string IdentifierStr;
-static double NumVal;
-
-
-static int gettok() // lexer
-{
-    static int LastChar = ' ';
-
-    while (isspace(LastChar))
-        LastChar = getchar();
-
-    if (isalpha(LastChar))  // first char cannot be number if it is keyword/variable
-    {
-        IdentifierStr = LastChar;
-        LastChar = getchar();
-        
-        while (isalnum(LastChar))
-        {
-            IdentifierStr.push_back(LastChar);
-            LastChar = getchar();
-        }
-
-        if (IdentifierStr == "def")
-            return tok_def;
-
-        if (IdentifierStr == "extern")
-            return tok_extern;
-
-        return tok_identifier;
-    }
-
-    if (isdigit(LastChar) || LastChar == '.')   // Num values (Double (float64))
-    {
-        std::string NumStr;
-        do 
-        {
-            NumStr.push_back(LastChar);
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
-
-        NumVal = std::stod(NumStr, 0);
-        return tok_number;
-    }
-
-    if (LastChar == '#')   // comments
-    {
-        do
-        {
-            LastChar = getchar();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-        if (LastChar != EOF)
-            return gettok();    // ignore (no token for) comments, recursively find next token.
-    }
-
-    if (LastChar == EOF)
-        return tok_eof;
+#include <llvm/Support/CommandLine.h>
+
+#include "Engine.h"
+#include "Server.h"
+
+
+static llvm::cl::opt<kaleidoscope::FPMode> FPMode("fp-mode",
+    llvm::cl::desc("Floating-point semantics:"),
+    llvm::cl::values(
+        clEnumValN(kaleidoscope::FPMode::Strict, "strict", "IEEE semantics, no reassociation or contraction"),
+        clEnumValN(kaleidoscope::FPMode::Contract, "contract", "Allow fusing a*b+c into FMA"),
+        clEnumValN(kaleidoscope::FPMode::Fast, "fast", "All fast-math flags (reassociation, no NaN/Inf, ...)")),
+    llvm::cl::init(kaleidoscope::FPMode::Strict));
+
+static llvm::cl::opt<bool> DisableTRE("no-tre",
+    llvm::cl::desc("Do not turn tail recursion into loops"));
+
+static llvm::cl::opt<bool> EnableIPO("ipo",
+    llvm::cl::desc("Inline and propagate constants across definitions, "
+                   "including ones JIT'd in earlier modules"));
+static llvm::cl::opt<unsigned> IPOInlineThreshold("ipo-inline-threshold",
+    llvm::cl::desc("Inliner cost threshold used by -ipo"),
+    llvm::cl::init(225));
+
+static llvm::cl::opt<std::string> ProfileGen("pgo-gen",
+    llvm::cl::desc("Instrument definitions and write their counters to <file> at exit"),
+    llvm::cl::value_desc("file"));
+static llvm::cl::opt<std::string> ProfileUse("pgo-use",
+    llvm::cl::desc("Optimize definitions using the counters in <file>"),
+    llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<unsigned> MemoEntries("memo-entries",
+    llvm::cl::desc("Cache entries per memo function (rounded up to a power of two)"),
+    llvm::cl::init(4096));
+
+static llvm::cl::opt<bool> NoProcessSymbols("no-process-symbols",
+    llvm::cl::desc("Bind externs only to the registered host functions"));
+
+static llvm::cl::opt<std::string> ServePath("serve",
+    llvm::cl::desc("Serve requests on the Unix socket <path> instead of reading stdin"),
+    llvm::cl::value_desc("path"));
+
+static llvm::cl::opt<unsigned> Jobs("jobs",
+    llvm::cl::desc("Compile runs of definitions on <n> threads; reads all of stdin first if n > 1"),
+    llvm::cl::value_desc("n"), llvm::cl::init(1));
+
+static llvm::cl::opt<bool> Timing("time",
+    llvm::cl::desc("Print time per compile stage and optimization pass at exit"));
+static llvm::cl::opt<std::string> TraceFile("trace",
+    llvm::cl::desc("Write a Chrome trace of every compile stage to <file> at exit"),
+    llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<bool> GDBJIT("gdb-jit",
+    llvm::cl::desc("Register JIT'd code with GDB's JIT interface"));
+static llvm::cl::opt<bool> PerfMap("perf-map",
+    llvm::cl::desc("Name JIT'd functions for perf in /tmp/perf-<pid>.map"));
+static llvm::cl::opt<bool> PerfJITDump("perf-jitdump",
+    llvm::cl::desc("Write a jitdump file of JIT'd code for 'perf inject --jit'"));
+
+static llvm::cl::opt<bool> CallStats("call-stats",
+    llvm::cl::desc("Count calls and cycles per definition; ':stats' prints them, "
+                   "':stats reset' zeroes them"));
+
+static llvm::cl::opt<unsigned> Verbosity("v",
+    llvm::cl::desc("Verbosity: 1 names each item as it is compiled, 2 also prints its IR"),
+    llvm::cl::init(0));
+static llvm::cl::opt<bool> DumpIRBefore("dump-ir-before",
+    llvm::cl::desc("Print each definition's IR before the optimization passes"));
+static llvm::cl::opt<bool> DumpIRAfter("dump-ir-after",
+    llvm::cl::desc("Print each definition's module after the optimization passes"));
+static llvm::cl::opt<bool> DumpAsm("dump-asm",
+    llvm::cl::desc("Print the assembly generated for each definition"));
+static llvm::cl::list<std::string> DumpFunctions("dump-func",
+    llvm::cl::desc("Only dump the definition <name> (__anon__ for expressions); may be repeated"),
+    llvm::cl::value_desc("name"));
+
+
+// True if Line, ignoring a trailing comment and whitespace, ends in ';'.
+static bool EndsStatement(const std::string &Line)
+{
+    size_t End = Line.find('#');
+    if (End == std::string::npos)
+        End = Line.size();
+
+    while (End > 0 && isspace((unsigned char)Line[End - 1]))
+        --End;
+
+    return End > 0 && Line[End - 1] == ';';
+}
+
+// REPL commands, which start with ':' on a line of their own. True if Line
+// was one.
+static bool RunCommand(kaleidoscope::Engine &E, const std::string &Line)
+{
+    std::istringstream In(Line);
+    std::string Command, Arg;
+    if (!(In >> Command) || Command[0] != ':')
+        return false;
+    In >> Arg;
+
+    if (Command == ":stats" && Arg.empty())
+        E.printCallStats();
+    else if (Command == ":stats" && Arg == "reset")
+        E.resetCallStats();
     else
-    {
-        int ThisChar = LastChar;
-        LastChar = getchar();
-        return ThisChar;
-    }
-}
-
-
-// AST tree nodes classes
-
-class ExprAST
-{
-public:
-    virtual ~ExprAST()
-    {}
-    virtual llvm::Value* codegen() = 0;
-};
-using uptrArgsV = typename std::vector<std::unique_ptr<ExprAST>>;
-using uptrAST = typename std::unique_ptr<ExprAST>;
-
-
-class NumberExprAST : public ExprAST
-{
-    double Val;
-
-public:
-    NumberExprAST(double val)
-        : Val(val){}
-
-    virtual llvm::Value *codegen();
-};
-
-
-class VariableExprAST : public ExprAST
-{
-    std::string Name;
-
-public:
-    VariableExprAST(const std::string &name)
-        :Name(name){}
-
-    virtual llvm::Value *codegen();
-};
-
-class BinaryExprAST : public ExprAST
-{
-    char Op;
-    uptrAST LHS, RHS;
-
-public:
-    BinaryExprAST(char op, uptrAST lhs, uptrAST rhs)
-        :Op(op), LHS(std::move(lhs)), RHS(std::move(rhs))
-    {}
-
-    virtual llvm::Value *codegen();
-};
-
-class CallExprAST : public ExprAST
-{
-    std::string Callee;
-    uptrArgsV Args;
-
-public:
-    CallExprAST(const std::string &callee, uptrArgsV args)
-        : Callee(callee), Args(std::move(args)) {}
-
-    virtual llvm::Value *codegen();
-};
-
-
-// Function Prototype
-class PrototypeAST
-{
-    std::string Name;
-    std::vector<std::string> Args;
-
-public:
-    PrototypeAST(const std::string &name, std::vector<std::string> args)
-        : Name(name), Args(args) {}
-
-    const std::string &getName() const 
-    {
-        return Name;
-    }
-
-    virtual llvm::Function *codegen();
-};
-
-
-// Function defination
-using uptrProto = typename std::unique_ptr<PrototypeAST>;
-class FunctionAST
-{
-    uptrProto Proto;
-    uptrAST Body;
-
-public:
-    FunctionAST(uptrProto proto, uptrAST body)
-        : Proto(std::move(proto)), Body(std::move(body)) {}
-
-    virtual llvm::Function *codegen();
-};
-
-// Parser
-static int Curtok;
-static int getNextToken() 
-{
-    Curtok = gettok();
-    return Curtok;
+        fprintf(stderr, "Unknown command %s\n", Line.c_str());
+    return true;
 }
 
-// Error Handling
-uptrAST LogError(const char *str)
+static void Run(kaleidoscope::Engine &E, const std::string &Source)
 {
-    fprintf(stderr, "LogError: %s\n", str);
-    return nullptr;
-}
-
-uptrProto LogErrorP(const char *str)
-{
-    LogError(str);
-    return nullptr;
-}
-
-// Forward declarations For parsing functions
-static uptrAST ParseNumberExpr();
-static uptrAST ParseExpression();
-static uptrAST ParsePrimary();
-static uptrAST ParseParenExpr();
-static uptrAST ParseIdentifierExpr();
-static uptrAST ParseBinOpRHS(int, uptrAST);
-
-
-// Expr Parsing
-static uptrAST ParseNumberExpr()
-{
-    auto Result = std::unique_ptr<NumberExprAST>(new NumberExprAST(NumVal));
-    getNextToken();
-
-    return std::move(Result);
-}
-
-
-static uptrAST ParseParenExpr()
-{
-    getNextToken(); // ( gone
-
-    auto V = ParseExpression();
+    std::vector<double> Results;
+    if (!E.compile(Source, &Results))
+        for (const std::string &Error : E.getErrors())
+            fprintf(stderr, "Error: %s\n", Error.c_str());
 
-    if (!V)
-        return nullptr;
-
-    if (Curtok != ')')
-        return LogError("expected ')'");
-
-    getNextToken(); // )
-    return V;
+    for (double V : Results)
+        fprintf(stderr, "Evaluated to %f\n", V);
 }
 
 
-static uptrAST ParseIdentifierExpr()
+int main(int argc, char **argv)
 {
-    std::string IdName = IdentifierStr;
-    
-    getNextToken();
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT REPL\n");
 
-    if (Curtok != '(')  // form identifier are Variables
-        return std::unique_ptr<VariableExprAST>(new VariableExprAST(IdName));
+    kaleidoscope::EngineOptions Opts;
+    Opts.FloatMode = FPMode;
+    Opts.IPO = EnableIPO;
+    Opts.IPOInlineThreshold = IPOInlineThreshold;
+    Opts.TailRecursionElim = !DisableTRE;
+    Opts.ProfileGen = ProfileGen;
+    Opts.ProfileUse = ProfileUse;
+    Opts.MemoEntries = MemoEntries;
+    Opts.ProcessSymbols = !NoProcessSymbols;
+    Opts.Jobs = std::max(1u, (unsigned)Jobs);
+    Opts.Timing = Timing;
+    Opts.TraceFile = TraceFile;
+    Opts.DebuggerRegistration = GDBJIT;
+    Opts.PerfMap = PerfMap;
+    Opts.PerfJITDump = PerfJITDump;
+    Opts.CallStats = CallStats;
+    Opts.Verbosity = Verbosity;
+    Opts.DumpIRBefore = DumpIRBefore;
+    Opts.DumpIRAfter = DumpIRAfter;
+    Opts.DumpAsm = DumpAsm;
+    Opts.DumpFunctions.assign(DumpFunctions.begin(), DumpFunctions.end());
 
-    getNextToken(); // ( gone
+    kaleidoscope::Engine E(Opts);
 
-
-    /* Identifier() is a call */
-    uptrArgsV Args;
-    if (Curtok != ')')
+    if (!ServePath.empty())
     {
-        while (true)
+        kaleidoscope::Server S(E);
+        if (!S.listen(ServePath))
         {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
-
-            if (Curtok == ')')
-                break;
-
-            if (Curtok != ',')
-                return LogError("Expected ')' or ','");
-            getNextToken();
+            fprintf(stderr, "%s\n", S.getLastError().c_str());
+            return 1;
         }
-    }
-
-    getNextToken();
 
-    return std::unique_ptr<CallExprAST>(new CallExprAST(IdName, std::move(Args)));   
-}
-
-static uptrAST ParsePrimary()
-{
-    switch (Curtok)
-    {
-    case tok_identifier:
-        return ParseIdentifierExpr();
-        break;
-    case tok_number:
-        return ParseNumberExpr();
-        break;
-    case '(':
-        return ParseParenExpr();
-        break;
-    default:
-        return LogError("Unknown Token");
+        S.run();
+        fprintf(stderr, "%s\n", S.getLastError().c_str());
+        return 1;
     }
-}
-
-// Binops
-static std::unordered_map<char, int> BinOpPrecedence;
-
-static int GetTokenPrecedence()
-{
-    if (!isascii(Curtok))
-        return -1;
 
-    if (BinOpPrecedence.find(Curtok) == BinOpPrecedence.end())
-    {
-        return -1;
-    }
-    else
+    // Definitions are only compiled in parallel within one compile() call,
+    // so take the input as a single script.
+    if (Opts.Jobs > 1)
     {
-        return BinOpPrecedence[Curtok];
-    }
-    
-}
-
+        std::stringstream Script;
+        Script << std::cin.rdbuf();
+        Run(E, Script.str());
 
-static uptrAST ParseExpression()
-{
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
-
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-
-static uptrAST ParseBinOpRHS(int ExprPrec, uptrAST LHS)
-{
-    while (true)
-    {
-        int TokPrec = GetTokenPrecedence();
-
-        if (TokPrec < ExprPrec) // ExprPrec start from 0, lease op token prec is 1.
-            return LHS;
-        
-        int BinOp = Curtok; // All non operation token will have prec = -1
-        getNextToken();
-
-        auto RHS = ParsePrimary();  // Recursively parse next
-        if (!RHS)
-            return nullptr;
-
-        int NextPrec = GetTokenPrecedence();
-        if (TokPrec < NextPrec)
-        {
-            /* If next precedent is higher, process next first */
-            RHS = ParseBinOpRHS(TokPrec+1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
-        }
-        
-        // Merge lhs and rhs
-        LHS = std::unique_ptr<BinaryExprAST>(
-            new BinaryExprAST(BinOp, std::move(LHS), std::move(RHS))
-        );
-    }
-}
-
-// Prototype
-
-static uptrProto ParsePrototype()
-{
-    if (Curtok != tok_identifier)
-        return LogErrorP("Expected function name in prototype");
-    
-    std::string fnName = IdentifierStr;
-    getNextToken();
-
-    if (Curtok != '(')
-        return LogErrorP("Expected ( ");
-
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
-
-    if (Curtok != ')')
-        return LogErrorP("Expected )");
-
-    getNextToken();
-    
-    return std::unique_ptr<PrototypeAST>(
-        new PrototypeAST(fnName, std::move(ArgNames))
-    );
-}
-
-
-static std::unique_ptr<FunctionAST> ParseDefinition()
-{
-    getNextToken(); // eat def
-    auto Proto = ParsePrototype();
-    if (!Proto)
-        return nullptr;
-
-    auto Expr = ParseExpression();
-    if (!Expr)
-        return nullptr;
-        
-    return std::unique_ptr<FunctionAST>(
-            new FunctionAST(std::move(Proto), std::move(Expr))
-        );
-}
-
-static uptrProto ParseExtern()
-{
-    getNextToken(); //eat extern;
-    return ParsePrototype();
-}
-
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
-{
-    if (auto Expr = ParseExpression())
-    {
-        auto Proto = std::unique_ptr<PrototypeAST>(
-            new PrototypeAST("__anon__", std::vector<std::string>())
-        );
-        return std::unique_ptr<FunctionAST>(
-            new FunctionAST(std::move(Proto), std::move(Expr))
-        );
-    }
-    return nullptr;
-}
-
-/* LLVM */
-static llvm::LLVMContext TheContext;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unordered_map<std::string, llvm::Value*> NamedValues;
-static std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-
-llvm::Value *LogErrorV(const char *Str)
-{
-    LogError(Str);
-    return nullptr;
-}
-
-llvm::Value* NumberExprAST::codegen()
-{
-    return llvm::ConstantFP::get(TheContext, llvm::APFloat(Val));
-}
-
-
-llvm::Value* VariableExprAST::codegen()
-{
-    auto *V = NamedValues[Name];
-    if (!V)
-        LogErrorV("Unknown variable name");
-    return V;
-}
-
-llvm::Value* BinaryExprAST::codegen()
-{
-    auto L = LHS->codegen();
-    auto R = RHS->codegen();
-
-    if (!L || !R)
-        return nullptr;
-
-    switch (Op)
-    {
-        case '+':
-            return Builder->CreateFAdd(L, R, "addtmp");
-        case '-':
-            return Builder->CreateFSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateFMul(L, R, "multmp");
-        case '<':
-            L = Builder->CreateFCmpULT(L, R, "cmptmp");
-            return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext), "boolcmp");
-        
-        default:
-            return LogErrorV("Invalid operator");
-    }
-}
-
-
-llvm::Value* CallExprAST::codegen()
-{
-    llvm::Function *CalleeF = TheModule->getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
-
-    if (CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect number of args");
-
-    std::vector<llvm::Value *> ArgsV;
-    for (unsigned i=0, e = Args.size(); i != e; ++i)
-    {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())  // Check if it is nullptr
-            return nullptr;
+        E.printMemoStats();
+        E.printCallStats();
+        if (Timing)
+            E.printTimingReport();
+        return 0;
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
-
-
-llvm::Function *PrototypeAST::codegen()
-{
-    std::vector<llvm::Type*> Doubles(Args.size(), 
-                                    llvm::Type::getDoubleTy(TheContext));
-
-    llvm::FunctionType* FT = 
-        llvm::FunctionType::get(llvm::Type::getDoubleTy(TheContext), Doubles, false);
-    
-    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, 
-                                                Name, TheModule.get());
-
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
-    
-    return F;
-}
-
-
-//TODO: add function individual modules....
-
-llvm::Function* FunctionAST::codegen()
-{
-    // Find if the function is already defined using extern
-    llvm::Function* TheFunction = TheModule->getFunction(Proto->getName());
-
-    if (!TheFunction)
-        TheFunction = Proto->codegen();
-
-    if (!TheFunction)
-        return nullptr;
-
-    if (!TheFunction->empty())
-        return (llvm::Function*) LogErrorV("Function Cannot be redefined");
-
-    llvm::BasicBlock *BB = llvm::BasicBlock::Create(TheContext, "Entry", TheFunction);
-    Builder->SetInsertPoint(BB);
-
-    NamedValues.clear();
-
-    for (auto& Arg: TheFunction->args())
-        NamedValues[Arg.getName()] = &Arg;
-
-    if (llvm::Value* RetVal = Body->codegen())
-    {
-        Builder->CreateRet(RetVal);
-
-        llvm::verifyFunction(*TheFunction);
-
-        // Opt passes
-        TheFPM->run(*TheFunction);
-
-        return TheFunction;
-    }
-
-    TheFunction->eraseFromParent(); //Remove if error in the body
-    return nullptr;
-}
-
-
-
-// Driver
-static void InitializeModuleAndPasses() {
-
-    TheModule = std::unique_ptr<llvm::Module>(
-        new llvm::Module("my cool jit", TheContext)
-    );
-
-    // Configure JIT
-    TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-    // Create a new builder for the module.
-    Builder = std::unique_ptr<llvm::IRBuilder<>>(
-        new llvm::IRBuilder<>(TheContext)
-    );
-
-    // Passes
-    TheFPM = std::unique_ptr<llvm::legacy::FunctionPassManager>(
-        new llvm::legacy::FunctionPassManager(TheModule.get())
-    );
-
-    TheFPM->add(llvm::createInstructionCombiningPass());
-    TheFPM->add(llvm::createReassociatePass());
-    TheFPM->add(llvm::createGVNPass());
-    TheFPM->add(llvm::createCFGSimplificationPass());
-
-    TheFPM->doInitialization();
-    
-}
-
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Read function definition: \n");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-        }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void HandleExtern() {
-if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: \n");
-      FnIR->print(llvm::errs());
-      fprintf(stderr, "\n");
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void HandleTopLevelExpression() {
-// Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) 
+    // Statements may span lines; compile once one ends with ';'.
+    std::string Pending, Line;
+    fprintf(stderr, "ready> ");
+    while (std::getline(std::cin, Line))
     {
-        if (auto *FnIR = FnAST->codegen()) 
+        if (Pending.empty() && RunCommand(E, Line))
         {
-            fprintf(stderr, "Read top-level expression:");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-
-            // Remove the anonymous expression.
-            // FnIR->eraseFromParent();
-
-            /*************** JIT ******************/
-            // Create Handle
-            auto H = TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPasses();
-
-            // Search symbol
-            auto ExprSymbol = TheJIT->findSymbol("__anon__");
-            assert(ExprSymbol && "Function not found");
-
-            double (*FP)() = (double (*)())(intptr_t)llvm::cantFail(ExprSymbol.getAddress());
-            
-            fprintf(stderr, "Evaluated to %f\n", FP());
-
-            TheJIT->removeModule(H);
-
+            fprintf(stderr, "ready> ");
+            continue;
         }
-    } 
-    else 
-    {
-    // Skip token for error recovery.
-    getNextToken();
-    }
-}
 
-static void MainLoop()
-{
-    while (true)
-    {
-        fprintf(stderr, "ready> ");
+        Pending += Line;
+        Pending += '\n';
 
-        switch (Curtok)
+        if (EndsStatement(Line))
         {
-        case tok_eof:
-            return;
-        case ';':
-            getNextToken();
-            break;
-        case tok_def:
-            HandleDefinition();
-            break;
-        case tok_extern:
-            HandleExtern();
-            break;
-        default:
-            HandleTopLevelExpression();
-            break;
+            Run(E, Pending);
+            Pending.clear();
         }
+        fprintf(stderr, "ready> ");
     }
-}
 
+    if (!Pending.empty())
+        Run(E, Pending);
 
-int main()
-{
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmParser();
-    llvm::InitializeNativeTargetAsmPrinter();
-
-    BinOpPrecedence['<'] = 10;
-    BinOpPrecedence['+'] = 20;
-    BinOpPrecedence['-'] = 20;
-    BinOpPrecedence['*'] = 40;
-
-    fprintf(stderr, "ready> ");
-    getNextToken();
-
-    TheJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>();
-
-    InitializeModuleAndPasses();
-
-    MainLoop();
-
-    TheModule->print(llvm::errs(), nullptr);
+    E.printMemoStats();
+    E.printCallStats();
+    if (Timing)
+        E.printTimingReport();
 
     return 0;
-}
\ No newline at end of file
+}
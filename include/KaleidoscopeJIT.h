@@ -14,8 +14,10 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -26,9 +28,11 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -42,16 +46,41 @@ public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
+  /// A symbol namespace: the modules added to it, the host symbols
+  /// registered with it and whether it may bind to the host process.
+  /// Modules in one Dylib never see definitions from another, but all
+  /// Dylibs share the target machine and the compile and link layers.
+  struct Dylib {
+    std::vector<VModuleKey> ModuleKeys;
+    StringMap<JITTargetAddress> HostSymbols;
+    bool ProcessSymbolFallback = true;
+    std::shared_ptr<SymbolResolver> Resolver;
+    /// Called with each object of D as it is linked, which happens on the
+    /// first lookup that needs it.
+    std::function<void(const object::ObjectFile &)> NotifyLoaded;
+  };
+
   KaleidoscopeJIT()
-      : Resolver(createLegacyLookupResolver(
-            ES,
-            [this](const std::string &Name) { return findMangledSymbol(Name); },
-            [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+      : TM(createTargetMachine()),
+        DL(TM->createDataLayout()),
         ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-                    [this](VModuleKey) {
+                    [this](VModuleKey K) {
                       return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                          std::make_shared<SectionMemoryManager>(),
+                          ModuleDylibs[K]->Resolver};
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &Info) {
+                      for (auto *L : EventListeners)
+                        L->notifyObjectLoaded(K, Obj, Info);
+                      Dylib *D = ModuleDylibs[K];
+                      if (D->NotifyLoaded)
+                        D->NotifyLoaded(Obj);
+                    },
+                    ObjLayerT::NotifyFinalizedFtor(),
+                    [this](VModuleKey K, const object::ObjectFile &) {
+                      for (auto *L : EventListeners)
+                        L->notifyFreeingObject(K);
                     }),
         CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
                      SimpleCompiler(*TM)) {
@@ -60,20 +89,88 @@ public:
 
   TargetMachine &getTargetMachine() { return *TM; }
 
-  VModuleKey addModule(std::unique_ptr<Module> M) {
+  /// A target machine like the JIT's own. TargetMachine is not thread-safe,
+  /// so modules compiled on other threads need one each.
+  static std::unique_ptr<TargetMachine> createTargetMachine() {
+    return std::unique_ptr<TargetMachine>(
+        EngineBuilder().setMCPU(sys::getHostCPUName()).selectTarget());
+  }
+
+  Dylib &createDylib() {
+    Dylibs.push_back(std::make_unique<Dylib>());
+    Dylib *D = Dylibs.back().get();
+    D->Resolver = createLegacyLookupResolver(
+        ES,
+        [this, D](const std::string &Name) { return findMangledSymbol(*D, Name); },
+        [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); });
+    return *D;
+  }
+
+  /// Remove D and every module still in it.
+  void removeDylib(Dylib &D) {
+    while (!D.ModuleKeys.empty())
+      removeModule(D.ModuleKeys.back());
+    Dylibs.erase(find_if(Dylibs, [&](const std::unique_ptr<Dylib> &P) {
+      return P.get() == &D;
+    }));
+  }
+
+  VModuleKey addModule(Dylib &D, std::unique_ptr<Module> M) {
     auto K = ES.allocateVModule();
+    ModuleDylibs[K] = &D;   // read by ObjectLayer when the object is added
     cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
+    D.ModuleKeys.push_back(K);
+    return K;
+  }
+
+  /// Add an object file already compiled for this target (SimpleCompiler
+  /// on a createTargetMachine()). It is linked on first lookup, like a
+  /// module, and removed with removeModule().
+  VModuleKey addObject(Dylib &D, std::unique_ptr<MemoryBuffer> Obj) {
+    auto K = ES.allocateVModule();
+    ModuleDylibs[K] = &D;
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    D.ModuleKeys.push_back(K);
     return K;
   }
 
   void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
+    auto &Keys = ModuleDylibs[K]->ModuleKeys;
+    Keys.erase(find(Keys, K));
+    ModuleDylibs.erase(K);
     cantFail(CompileLayer.removeModule(K));
   }
 
-  JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+  JITSymbol findSymbol(Dylib &D, const std::string Name) {
+    return findMangledSymbol(D, mangle(Name));
+  }
+
+  /// Look Name up in module K only, skipping the search through every
+  /// module, the host symbols and the process.
+  JITSymbol findSymbolIn(VModuleKey K, const std::string &Name) {
+    return CompileLayer.findSymbolIn(K, mangle(Name), false);
+  }
+
+  /// Bind Name to a host function or variable in D. Registered symbols are
+  /// found after JIT'd definitions and before the process-wide search.
+  void addHostSymbol(Dylib &D, const std::string &Name, void *Addr) {
+    D.HostSymbols[mangle(Name)] = pointerToJITTargetAddress(Addr);
+  }
+
+  /// Whether symbols that are neither JIT'd nor registered are looked up
+  /// in the host process. With this off, extern binding only depends on
+  /// what was registered.
+  void setProcessSymbolFallback(Dylib &D, bool Enabled) {
+    D.ProcessSymbolFallback = Enabled;
+  }
+
+  /// Tell L about every object linked from now on, in any Dylib, and about
+  /// its removal. For process-wide profiler and debugger interfaces, such
+  /// as JITEventListener::createGDBRegistrationListener(); adding the same
+  /// listener again does nothing.
+  void addEventListener(JITEventListener &L) {
+    if (!is_contained(EventListeners, &L))
+      EventListeners.push_back(&L);
   }
 
 private:
@@ -86,7 +183,7 @@ private:
     return MangledName;
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
+  JITSymbol findMangledSymbol(Dylib &D, const std::string &Name) {
 #ifdef _WIN32
     // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
     // flag to decide whether a symbol will be visible or not, when we call
@@ -103,13 +200,24 @@ private:
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
+    for (auto H : make_range(D.ModuleKeys.rbegin(), D.ModuleKeys.rend()))
       if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
         return Sym;
 
-    // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
+    // Then in the host symbols registered up front.
+    auto HI = D.HostSymbols.find(Name);
+    if (HI != D.HostSymbols.end())
+      return JITSymbol(HI->second, JITSymbolFlags::Exported);
+
+    if (!D.ProcessSymbolFallback)
+      return nullptr;
+
+    // If we can't find the symbol in the JIT, try looking in the host
+    // process, and remember it so the dynamic linker is asked only once.
+    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name)) {
+      D.HostSymbols[Name] = SymAddr;
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+    }
 
 #ifdef _WIN32
     // For Windows retry without "_" at beginning, as RTDyldMemoryManager uses
@@ -125,12 +233,13 @@ private:
   }
 
   ExecutionSession ES;
-  std::shared_ptr<SymbolResolver> Resolver;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
-  std::vector<VModuleKey> ModuleKeys;
+  std::vector<std::unique_ptr<Dylib>> Dylibs;
+  std::map<VModuleKey, Dylib *> ModuleDylibs;
+  std::vector<JITEventListener *> EventListeners;
 };
 
 } // end namespace orc